@@ -2,6 +2,7 @@
 #include <bbb_sdhc.h>
 #include <bbb_sdhc_host.h>
 #include <bbb_sdhc_mmc.h>
+#include <bbb_sdhc_sd.h>
 #include <common.h>
 #include <command.h>
 #include <errno.h>
@@ -13,16 +14,52 @@
 #include <menu.h>
 #include <post.h>
 #include <u-boot/sha256.h>
+#include <u-boot/crc.h>
+#include <bootstage.h>
 
+static int card_send_status(uint32_t *r1);
 int card_trans_status(void);
 int card_enter_trans(void);
+int card_busy_done(int timeout_ms);
+void card_set_dto(dto_class_t cls, unsigned int busy_ms);
 int card_get_cid(void);
 void card_cmd_config(command_t * cmd, int index, int argument, xfer_type_t transfer,
                      response_format_t format, data_present_select data,
                      crc_check_enable crc, cmdindex_check_enable cmdindex);
 static int card_software_reset(void);
 int card_emmc_init(void);
+int card_emmc_init_start(void);
+int card_emmc_init_step(void);
+int card_emmc_init_wait(void);
+static int card_init_ready(void);
+static int card_set_bus_level(bus_level_t level);
 int card_data_read(int *dst_ptr, int length, uint32_t offset);
+int card_data_read_digest(int *dst_ptr, int length, uint32_t offset,
+			  digest_type_t type, uint8_t *digest);
+int card_data_write(int *src_ptr, int length, uint32_t offset);
+int card_sect_read(int *dst_ptr, uint32_t lba, uint32_t count);
+int card_sect_write(int *src_ptr, uint32_t lba, uint32_t count);
+int card_stream_read(uint32_t offset, int length, stream_fn_t fn, void *ctx);
+int card_erase(erase_range_t *ranges, int count, erase_partial_t partial);
+int card_emmc_quiesce(void);
+int card_emmc_sleep(void);
+int card_emmc_awake(void);
+int card_wbuf_write(int *src_ptr, int length, uint32_t offset);
+int card_wbuf_sync(void);
+int card_sched_write(int *src_ptr, int length, uint32_t offset);
+void card_print_stats(void);
+void card_mark_phase(card_phase_t phase);
+void card_print_init_times(void);
+static int card_wbuf_dirty(uint32_t lba, uint32_t count);
+static void card_wbuf_invalidate(uint32_t lba, uint32_t count);
+int card_async_submit(card_req_t *req);
+int card_async_poll(int handle);
+int card_async_wait(int handle);
+int card_async_pending(void);
+static void card_async_idle(void);
+void sdhc_arena_reset(void);
+void *sdhc_arena_alloc(uint32_t size);
+static int card_buf_init(void);
 
 /* Global Variables */
 
@@ -36,6 +73,109 @@ sdhc_inst_t sdhc_device = {
      1,                 //status
 };
 
+/* Boot profile and bootstage names of the init phases */
+static const char *const card_phase_names[PHASE_COUNT] = {
+	[PHASE_HOST_RESET]  = "sdhc_host_reset",
+	[PHASE_INIT_CLOCKS] = "sdhc_init_clocks",
+	[PHASE_CMD0]        = "sdhc_cmd0",
+	[PHASE_PROBE]       = "sdhc_probe",
+	[PHASE_OCR]         = "sdhc_ocr",
+	[PHASE_IDENT]       = "sdhc_cid_rca",
+	[PHASE_CSD]         = "sdhc_csd",
+	[PHASE_EXT_CSD]     = "sdhc_ext_csd",
+	[PHASE_CONFIG]      = "sdhc_config",
+	[PHASE_BUS_MODE]    = "sdhc_bus_mode",
+	[PHASE_INIT_DONE]   = "sdhc_init_done",
+	[PHASE_FIRST_DATA]  = "sdhc_first_data",
+};
+
+/* Backing store of the device arena */
+static uint8_t sdhc_pool[SDHC_ARENA_SIZE] __aligned(ARCH_DMA_MINALIGN);
+
+static wbuf_state_t wbuf;
+static int *wbuf_data;
+static int *stream_ring[STREAM_RING_DEPTH];
+static uint8_t *read_sector;
+
+/* Asynchronous request queue */
+static card_slot_t async_slot[CARD_ASYNC_DEPTH];
+static host_xfer_t async_xfer;
+static int async_active = -1;
+static unsigned int async_seq;
+
+/*!
+ * @brief Empty the device arena, every block handed out before is dropped
+ */
+void sdhc_arena_reset(void)
+{
+	sdhc_device.arena.base = sdhc_pool;
+	sdhc_device.arena.size = sizeof(sdhc_pool);
+	sdhc_device.arena.used = 0;
+}
+
+/*!
+ * @brief Hand out a cache line aligned block of the device arena
+ *
+ * Blocks are only given back all at once by sdhc_arena_reset().
+ *
+ * @param size         Block size in bytes
+ * 
+ * @return             Pointer to the block; NULL if the arena is full
+ */
+void *sdhc_arena_alloc(uint32_t size)
+{
+	sdhc_arena_t *arena = &sdhc_device.arena;
+	uint8_t *ptr;
+
+	size = ALIGN(size, ARCH_DMA_MINALIGN);
+
+	if ((arena->base == NULL) || (size > (arena->size - arena->used)))
+	{
+		printf("sdhc_arena_alloc: no room for %d bytes.\n", size);
+		return NULL;
+	}
+
+	ptr = arena->base + arena->used;
+	arena->used += size;
+
+	return ptr;
+}
+
+/*!
+ * @brief Take the write buffer and stream ring from the device arena
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_buf_init(void)
+{
+	int slot;
+
+	memset(&wbuf, 0, sizeof(wbuf));
+
+	wbuf_data = sdhc_arena_alloc(WBUF_SECTORS * BLK_LEN);
+	if (!wbuf_data)
+	{
+		return FAIL;
+	}
+
+	for (slot = 0; slot < STREAM_RING_DEPTH; slot++)
+	{
+		stream_ring[slot] = sdhc_arena_alloc(STREAM_CHUNK_SECTORS * BLK_LEN);
+		if (!stream_ring[slot])
+		{
+			return FAIL;
+		}
+	}
+
+	read_sector = sdhc_arena_alloc(BLK_LEN);
+	if (!read_sector)
+	{
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
 void host_clear_fifo(void)
 {
 	unsigned int val, idx;
@@ -53,30 +193,87 @@ void host_clear_fifo(void)
 	val = __raw_readl(0x481D8230) & ~0x00000020;
 	val |= 0x00000020;
 	__raw_writel(val, 0x481D8230);	
+
+	sdhc_device.fifo_clean = TRUE;
 }
 
+/*!
+ * @brief Set the card block length, skipped if the card already has it
+ *
+ * @param len          Block length in bytes
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
 int card_set_blklen(int len)
 {
-	command_t cmd;
 	int status = FAIL;
 
-	card_cmd_config(&cmd, CMD16, len, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+	if (sdhc_device.blk_len == len)
+	{
+		return SUCCESS;
+	}
+
+	/* CMD16 is illegal in DDR mode, where the length is always 512 */
+	if ((sdhc_device.bus_level == BUS_DDR52_8BIT) && (len == BLK_LEN))
+	{
+		sdhc_device.blk_len = len;
+		return SUCCESS;
+	}
+
 	printf("Send CMD16.\n");
 
-	if (host_send_cmd(&cmd) == SUCCESS)
+	if (host_send_fast_cmd(FAST_CMD16, len) == SUCCESS)
 	{
+		sdhc_device.blk_len = len;
 		status = SUCCESS;
 	}
+	else
+	{
+		sdhc_device.blk_len = 0;
+	}
 
 	return status;
 }
 
 /* Whether to enable ADMA */
-//static int SDHC_ADMA_mode = FALSE;
+static int SDHC_ADMA_mode = TRUE;
 
 /* Whether to enable Interrupt */
 //static int SDHC_INTR_mode = FALSE;
 
+/*!
+ * @brief Read the card status register with CMD13
+ *
+ * @param r1           Card status
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_send_status(uint32_t *r1)
+{
+	command_response_t response;
+
+	printf("Send CMD13.\n");
+
+	/* Send CMD13 */
+	if (host_send_fast_cmd(FAST_CMD13, sdhc_device.rca << RCA_SHIFT) == FAIL)
+	{
+		return FAIL;
+	}
+
+	/* Get Response */
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	if (response.cmd_rsp0 & R1_EXCEPTION_EVENT)
+	{
+		sdhc_device.exception = TRUE;
+	}
+
+	*r1 = response.cmd_rsp0;
+
+	return SUCCESS;
+}
+
 /*!
  * @brief Addressed card send its status register
  *
@@ -86,34 +283,91 @@ int card_set_blklen(int len)
  */
 int card_trans_status(void)
 {
-	command_t cmd;
-	command_response_t response;
-	int card_state, card_address, status = FAIL;
+	uint32_t r1;
 
-	/* Get RCA */
-	card_address = sdhc_device.rca << RCA_SHIFT;
+	/* Read card state from response */
+	if ((card_send_status(&r1) == SUCCESS) && (CURR_CARD_STATE(r1) == TRAN) &&
+	    !(r1 & R1_SWITCH_ERROR))
+	{
+		return SUCCESS;
+	}
 
-	/* Configure CMD13 */
-	card_cmd_config(&cmd, CMD13, card_address, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+	return FAIL;
+}
 
-	printf("Send CMD13.\n");
+/*!
+ * @brief Finish an R1b command on the busy end signalled by the host
+ *
+ * The card is taken to be done when TC marks the end of busy and its R1
+ * shows no error. CMD13 is only sent when R1 reports an error or the busy
+ * timeout expires, to find out where the card really is.
+ *
+ * @param timeout_ms   Busy timeout
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int card_busy_done(int timeout_ms)
+{
+	command_response_t response;
+	int busy_status;
 
-	/* Send CMD13 */
-	if (host_send_cmd(&cmd) == SUCCESS)
+	busy_status = host_wait_busy(timeout_ms);
+
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	if ((busy_status == SUCCESS) && !(response.cmd_rsp0 & R1_BUSY_CMD_ERRORS))
 	{
-		/* Get Response */
-		response.format = RESPONSE_48;
-		host_read_response(&response);
+		return SUCCESS;
+	}
+
+	printf("R1b status 0x%x, checking card state.\n", response.cmd_rsp0);
+
+	return card_trans_status();
+}
+
+/*!
+ * @brief Program the data timeout for the next operation
+ *
+ * Reads allow ten times the CSD access time (TAAC + NSAC), writes that
+ * again times 2^R2W_FACTOR, both with a floor for cards that report tiny
+ * access times. Erase and switch use the busy time from EXT_CSD.
+ *
+ * @param cls          Class of the next operation
+ * @param busy_ms      Busy timeout for DTO_ERASE and DTO_SWITCH
+ */
+void card_set_dto(dto_class_t cls, unsigned int busy_ms)
+{
+	unsigned int mult = CARD_ACCESS_MULT;
+	unsigned int floor_us = CARD_READ_TMO_MIN * 1000;
+	unsigned int timeout_us;
+
+	switch (cls) {
+	case DTO_WRITE:
+		mult <<= sdhc_device.r2w_factor;
+		floor_us = CARD_WRITE_TMO_MIN * 1000;
+		/* fall through */
 
-		/* Read card state from response */
-		card_state = CURR_CARD_STATE(response.cmd_rsp0);
-		if (card_state == TRAN)
+	case DTO_READ:
+		timeout_us = (sdhc_device.taac_ns / 1000) * mult;
+		if (timeout_us < floor_us)
 		{
-			status = SUCCESS;
+			timeout_us = floor_us;
 		}
-	}
 
-	return status;
+		host_set_data_timeout(timeout_us, sdhc_device.nsac_clks * mult);
+		break;
+
+	case DTO_ERASE:
+	case DTO_SWITCH:
+		if (busy_ms > (0xFFFFFFFF / 1000))
+		{
+			busy_ms = 0xFFFFFFFF / 1000;
+		}
+
+		host_set_data_timeout(busy_ms * 1000, 0);
+		break;
+	}
 }
 
 /*!
@@ -125,25 +379,19 @@ int card_trans_status(void)
  */
 int card_enter_trans(void)
 {
-	command_t cmd;
 	int card_address, status = FAIL;
 
 	/* Get RCA */
 	card_address = sdhc_device.rca << RCA_SHIFT;
 
-	/* Configure CMD7 */
-	card_cmd_config(&cmd, CMD7, card_address, READ, RESPONSE_48_CHECK_BUSY, DATA_PRESENT_NONE, TRUE, TRUE);
-
 	printf("Send CMD7");
 
-	/* Send CMD7 */
-	if (host_send_cmd(&cmd) == SUCCESS)
+	card_set_dto(DTO_SWITCH, MMC_SWITCH_DEF_TIMEOUT);
+
+	/* Send CMD7, the card is in TRAN once it releases busy */
+	if (host_send_fast_cmd(FAST_CMD7, card_address) == SUCCESS)
 	{
-		/* Check of the card is in TRAN state */
-		if (card_trans_status() == SUCCESS)
-		{
-			status = SUCCESS;
-		}
+		status = card_busy_done(MMC_SWITCH_DEF_TIMEOUT);
 	}
 
 	return status;
@@ -241,107 +489,2046 @@ static int card_software_reset(void)
 	return response;
 }
 
-int card_data_read(int *dst_ptr, int length, uint32_t offset)
+/*!
+ * @brief Convert a sector number to a card data address
+ *
+ * @param lba          Sector number
+ *
+ * @return             Argument for data and erase commands
+ */
+static uint32_t card_blk_addr(uint32_t lba)
 {
-	int port, sector;
-	command_t cmd;
+	return (sdhc_device.addr_mode == SECT_MODE) ? lba : (lba * BLK_LEN);
+}
+
+/*!
+ * @brief Fill in a CMD18 or CMD25 transfer without touching the controller
+ *
+ * @param xfer         Transfer to set up
+ * @param dir          READ or WRITE
+ * @param buf          Data buffer
+ * @param length       Data length in bytes
+ */
+static void card_blk_setup(host_xfer_t *xfer, xfer_type_t dir, int *buf, int length)
+{
+	xfer->dir = dir;
+	xfer->buf = buf;
+	xfer->length = length;
+	xfer->prepared = FALSE;
 
-	printf("card_data_read: Read 0x%x bytes from SD%d offset 0x%x to 0x%x.\n",
-	       length, port + 1, offset, (int)dst_ptr);
+	/* ADMA works on the caller buffer in place if it is word aligned */
+	xfer->dma = (SDHC_ADMA_mode == TRUE) && (((unsigned long) buf & 0x3) == 0);
+	xfer->wml = host_wml_select(xfer->dma);
+}
 
-	sector = length / BLK_LEN;
+/*!
+ * @brief Issue CMD18 or CMD25 for a transfer set up by card_blk_setup()
+ *
+ * @param xfer         Transfer to start, at most CARD_CHUNK_SECTORS sectors
+ * @param lba          First sector
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_blk_issue(host_xfer_t *xfer, uint32_t lba)
+{
+	int index = (xfer->dir == READ) ? CMD18 : CMD25;
 
-	if ((length % BLK_LEN) != 0) {
-		sector++;
+	/* Reads interrupt any long card operation instead of waiting for it */
+	if ((xfer->dir == READ) && sdhc_device.hpi_en && host_card_busy()) {
+		if (mmc_hpi_preempt() == FAIL) {
+			return FAIL;
+		}
 	}
-
-	if (sdhc_device.addr_mode == SECT_MODE) {
-		offset = offset / BLK_LEN;
-		printf("The offset is %x.\n", offset);
+	else if (sdhc_device.bkops_running && (mmc_bkops_finish() == FAIL)) {
+		return FAIL;
 	}
 
 	if (card_set_blklen(BLK_LEN) == FAIL) {
-		printf("Fail to set block length to card in reading sector %d");
+		printf("Fail to set block length to card at sector %d.\n", lba);
 		return FAIL;
 	}
 
-	host_clear_fifo();
+	/* Only drain the FIFO if an earlier transfer may have left data in it */
+	if ((xfer->dir == READ) && !sdhc_device.fifo_clean) {
+		host_clear_fifo();
+	}
 
-	host_cfg_block(BLK_LEN, sector);
+	host_cfg_block(BLK_LEN, DIV_ROUND_UP(xfer->length, BLK_LEN));
 
-	card_cmd_config(&cmd, CMD18, offset, READ, RESPONSE_48, DATA_PRESENT, TRUE, TRUE);
+	printf("card_blk_issue: Send CMD%d.\n", index);
 
-	printf("card_data_read: Send CMD18.\n");
+	card_set_dto((xfer->dir == READ) ? DTO_READ : DTO_WRITE, 0);
 
-	if (host_send_cmd(&cmd) == FAIL)
+	if (host_xfer_start_fast((xfer->dir == READ) ? FAST_CMD18 : FAST_CMD25,
+				 card_blk_addr(lba), xfer) == FAIL)
 	{
-		printf("Fail to send CMD18.\n");
+		printf("Fail to send CMD%d.\n", index);
 		return FAIL;
 	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Issue CMD18 or CMD25 for a sector range without waiting for the data
+ *
+ * @param xfer         Transfer to start
+ * @param dir          READ or WRITE
+ * @param buf          Data buffer
+ * @param lba          First sector
+ * @param length       Data length in bytes, at most CARD_CHUNK_SECTORS sectors
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_blk_start(host_xfer_t *xfer, xfer_type_t dir, int *buf, uint32_t lba, int length)
+{
+	card_blk_setup(xfer, dir, buf, length);
+
+	return card_blk_issue(xfer, lba);
+}
+
+/*!
+ * @brief Account a finished write in the traffic statistics
+ *
+ * @param lba          First sector
+ * @param sectors      Number of sectors written
+ */
+static void card_stats_write(uint32_t lba, uint32_t sectors)
+{
+	uint32_t unit = sdhc_device.opt_write_size;
+
+	sdhc_device.stats.wr_cmds++;
+	sdhc_device.stats.wr_sectors += sectors;
+	sdhc_device.bkops_wr += sectors;
+
+	if ((unit != 0) && ((lba % unit) == 0) && ((sectors % unit) == 0))
+	{
+		sdhc_device.stats.wr_aligned += sectors;
+	}
+}
+
+/*!
+ * @brief Note an R1 exception event of the last data command
+ *
+ * The card raises it for urgent BKOPS among others, mmc_bkops_idle() reads
+ * EXT_CSD to find out which.
+ */
+static void card_check_exception(void)
+{
+	command_response_t response;
+
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	if (response.cmd_rsp0 & R1_EXCEPTION_EVENT)
+	{
+		sdhc_device.exception = TRUE;
+	}
+}
+
+/*!
+ * @brief Bytes in the next chunk of a planned transfer
+ *
+ * @param left         Sectors left, at least one
+ * @param last_len     Bytes used in the final sector
+ *
+ * @return             Chunk length in bytes
+ */
+static int card_blk_chunk_len(uint32_t left, int last_len)
+{
+	if (left > CARD_CHUNK_SECTORS)
+	{
+		return CARD_CHUNK_SECTORS * BLK_LEN;
+	}
+
+	return ((left - 1) * BLK_LEN) + last_len;
+}
+
+/*!
+ * @brief Move to a bus speed level the way the card type does it
+ *
+ * @param level        Target level
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_set_bus_level(bus_level_t level)
+{
+	return (sdhc_device.card_type == CARD_SD) ? sd_set_bus_level(level) :
+						    mmc_set_bus_level(level);
+}
+
+/*!
+ * @brief Count a transfer outcome and move along the bus speed ladder
+ *
+ * Too many errors in one window step the bus down a level. A long error
+ * free run steps it back up one level; if the card fails the check there
+ * the current level is restored.
+ *
+ * @param ok           Transfer finished without a data error
+ */
+static void card_bus_account(int ok)
+{
+	int level = sdhc_device.bus_level;
+
+	if (ok)
+	{
+		sdhc_device.bus_clean++;
+	}
 	else
 	{
-		printf("Read data from FIFO.\n");
+		sdhc_device.bus_errs++;
+		sdhc_device.bus_clean = 0;
+	}
+
+	if (++sdhc_device.bus_xfers >= CARD_BUS_ERR_WINDOW)
+	{
+		sdhc_device.bus_xfers = 0;
+		sdhc_device.bus_errs = 0;
+	}
+
+	if ((sdhc_device.bus_errs >= CARD_BUS_ERR_LIMIT) && (level > BUS_LEGACY_1BIT))
+	{
+		printf("Too many data errors, stepping bus down.\n");
 
-		if (host_data_read(dst_ptr, length, ESDHC_BLKATTR_WML_BLOCK) == FAIL)
+		while ((--level > BUS_LEGACY_1BIT) && (card_set_bus_level(level) == FAIL))
 		{
-			printf("Fail to read data from card.\n");
-			return FAIL;
+			;
+		}
+
+		if (level == BUS_LEGACY_1BIT)
+		{
+			card_set_bus_level(BUS_LEGACY_1BIT);
 		}
+
+		sdhc_device.stats.bus_downs++;
+		sdhc_device.bus_xfers = 0;
+		sdhc_device.bus_errs = 0;
 	}
+	else if ((sdhc_device.bus_clean >= CARD_BUS_UP_XFERS) &&
+		 (level < sdhc_device.bus_level_max))
+	{
+		printf("Trying bus step up.\n");
 
-	printf("card_data_read: Data read successful.\n");
+		if (card_set_bus_level(level + 1) == SUCCESS)
+		{
+			sdhc_device.stats.bus_ups++;
+		}
+		else
+		{
+			card_set_bus_level(level);
+		}
 
-	return SUCCESS;
+		sdhc_device.bus_clean = 0;
+	}
 }
 
-int card_emmc_init(void)
+/*!
+ * @brief Stop a multiple block transfer that ended in an error
+ *
+ * The auto CMD12 may already have stopped the card, then this CMD12 is
+ * illegal and only the state check matters. Writes may still be
+ * programming, so the card gets the write timeout to return to TRAN.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_stop_transfer(void)
 {
-	int init_status = FAIL;
-	unsigned int val = 0x00000000;
+	command_t cmd;
+	unsigned int start;
 
-	/* Software reset to host controller */
-	host_reset(SDHC_ONE_BIT_SUPPORT);
+	card_set_dto(DTO_WRITE, 0);
 
-	/* Enable Init Frequency */
-//	host_cfg_clock(INIT_FREQ);
-//	printf("Init frequency set.\n");
+	card_cmd_config(&cmd, CMD12, NO_ARG, READ, RESPONSE_48_CHECK_BUSY,
+			DATA_PRESENT_NONE, TRUE, TRUE);
 
-	/* Send Init 80 Clock */
-	host_init_active();
-	printf("80 clocks sent.\n");
-	
-	/* Enable Identification Frequency */
-//	host_cfg_clock(IDENTIFICATION_FREQ);
-//	printf("Ident frequency set.\n");
-
-	/* Issue Software Reset to card */
-	if (card_software_reset() == FAIL)
-	{
-		return init_status;
-		printf("CMD0 fail\n");
-	}
-	printf("Card reset Successfully\n");
-	
-	/* Software reset */
-	val = __raw_readl(0x481D822C) & ~0x02000000;
-	val |= 0x02000000;
-	__raw_writel(val, 0x481D822C);
-	
-	while (__raw_readl(0x481D822C) & 0x02000000)
+	if (host_send_cmd(&cmd) == SUCCESS)
 	{
-		;
+		host_wait_busy(CARD_WRITE_TMO_MIN);
 	}
-	printf("Software reset done\n");
-	
-	/* MMC Voltage Validation */
-	//if (mmc_voltage_validation() == SUCCESS)
-	if (mmc_voltage_validation() == SUCCESS)
+
+	start = get_timer(0);
+
+	while (card_trans_status() == FAIL)
 	{
-		/* MMC Initialization */
+		if (get_timer(start) > CARD_WRITE_TMO_MIN)
+		{
+			printf("Card did not return to TRAN after CMD12.\n");
+			return FAIL;
+		}
 
-		printf("card voltage validation success\n");
-		init_status = emmc_init();
+		udelay(1000);
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Move a sector range of any size with back to back CMD18 or CMD25
+ *
+ * SD_BLK counts at most CARD_CHUNK_SECTORS blocks, so the range goes out
+ * in chunks of that size. The controller takes no new command while data
+ * moves, but the cache maintenance of the next chunk is done while the
+ * current one is still in flight, so the next command follows the end of
+ * the current one directly.
+ *
+ * A data error does not start the range over. The transfer resumes at the
+ * first block not known to be intact, up to CARD_XFER_RETRIES times.
+ *
+ * @param dir          READ or WRITE
+ * @param buf          Data buffer
+ * @param lba          First sector
+ * @param count        Number of sectors
+ * @param last_len     Bytes used in the final sector, BLK_LEN for a full one
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_blk_xfer(xfer_type_t dir, uint8_t *buf, uint32_t lba, uint32_t count, int last_len)
+{
+	host_xfer_t xfer[2];
+	uint32_t sectors, intact;
+	int cur = 0, resumable, retries = CARD_XFER_RETRIES;
+
+	if (count == 0)
+	{
+		return SUCCESS;
+	}
+
+	if (card_init_ready() == FAIL)
+	{
+		return FAIL;
+	}
+
+	if (sdhc_device.asleep)
+	{
+		printf("Card asleep, wake it first.\n");
+		return FAIL;
+	}
+
+	card_async_idle();
+
+	card_blk_setup(&xfer[cur], dir, (int *) buf, card_blk_chunk_len(count, last_len));
+
+	while (1)
+	{
+		sectors = DIV_ROUND_UP(xfer[cur].length, BLK_LEN);
+
+		if (card_blk_issue(&xfer[cur], lba) == FAIL)
+		{
+			return FAIL;
+		}
+
+		/* Clean or invalidate the next chunk while this one moves */
+		if (count > sectors)
+		{
+			card_blk_setup(&xfer[!cur], dir, (int *) (buf + (sectors * BLK_LEN)),
+				       card_blk_chunk_len(count - sectors, last_len));
+			host_xfer_prepare(&xfer[!cur]);
+		}
+
+		if (host_xfer_wait(&xfer[cur]) == FAIL)
+		{
+			resumable = host_xfer_abort(&xfer[cur], &intact);
+
+			if (card_stop_transfer() == FAIL)
+			{
+				return FAIL;
+			}
+
+			card_bus_account(FALSE);
+
+			if ((resumable == FAIL) || (retries-- == 0))
+			{
+				return FAIL;
+			}
+
+			printf("Data error at sector 0x%x, resuming after %u good sectors.\n",
+			       lba, intact);
+
+			sdhc_device.stats.retries++;
+
+			buf += intact * BLK_LEN;
+			lba += intact;
+			count -= intact;
+
+			card_blk_setup(&xfer[cur], dir, (int *) buf, card_blk_chunk_len(count, last_len));
+			continue;
+		}
+
+		if (dir == WRITE)
+		{
+			card_stats_write(lba, sectors);
+			card_check_exception();
+		}
+
+		card_bus_account(TRUE);
+
+		buf += sectors * BLK_LEN;
+		lba += sectors;
+		count -= sectors;
+
+		if (count == 0)
+		{
+			break;
+		}
+
+		cur = !cur;
+	}
+
+	/* Reads during identification do not count as first data */
+	if ((sdhc_device.init_state == INIT_DONE) &&
+	    !(sdhc_device.phase_seen & (1 << PHASE_FIRST_DATA)))
+	{
+		card_mark_phase(PHASE_FIRST_DATA);
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Read sectors from the card with CMD18
+ *
+ * @param dst_ptr      Pointer for data destination
+ * @param lba          First sector
+ * @param length       Data length in bytes, the last sector may be partial
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_blk_read(int *dst_ptr, uint32_t lba, int length)
+{
+	uint32_t count;
+
+	if (length < 0)
+	{
+		printf("Invalid read length 0x%x.\n", length);
+		return FAIL;
+	}
+
+	count = DIV_ROUND_UP(length, BLK_LEN);
+
+	if (card_blk_xfer(READ, (uint8_t *) dst_ptr, lba, count,
+			  length - ((int) (count - 1) * BLK_LEN)) == FAIL)
+	{
+		printf("Fail to read data from card.\n");
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Write whole sectors to the card with CMD25
+ *
+ * @param src_ptr      Pointer for data source
+ * @param lba          First sector
+ * @param length       Data length in bytes, multiple of BLK_LEN
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_blk_write(int *src_ptr, uint32_t lba, int length)
+{
+	if (length < 0)
+	{
+		printf("Invalid write length 0x%x.\n", length);
+		return FAIL;
+	}
+
+	if (card_blk_xfer(WRITE, (uint8_t *) src_ptr, lba, length / BLK_LEN, BLK_LEN) == FAIL)
+	{
+		printf("Fail to write data to card.\n");
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Time the PIO burst candidates and keep the fastest for this mode
+ *
+ * Each candidate reads CARD_WML_CAL_SECTORS from sector 0 into the stream
+ * ring with ADMA off. The winner is stored with host_wml_set(), so it is
+ * used until the bus clock or width changes.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_wml_calibrate(void)
+{
+	static const int cand[] = { SDHC_WML_MIN, SDHC_WML_MIN * 2, SDHC_WML_MIN * 4,
+				    ESDHC_BLKATTR_WML_BLOCK };
+	unsigned long long ticks, best_ticks = ~0ULL;
+	int adma = SDHC_ADMA_mode;
+	int idx, best = 0;
+
+	SDHC_ADMA_mode = FALSE;
+
+	for (idx = 0; idx < ARRAY_SIZE(cand); idx++)
+	{
+		host_wml_set(cand[idx]);
+
+		ticks = get_ticks();
+
+		if (card_blk_read(stream_ring[0], 0, CARD_WML_CAL_SECTORS * BLK_LEN) == FAIL)
+		{
+			SDHC_ADMA_mode = adma;
+			host_wml_set(0);
+			return FAIL;
+		}
+
+		ticks = get_ticks() - ticks;
+
+		printf("WML %d words: %llu ticks.\n", cand[idx], ticks);
+
+		if (ticks < best_ticks)
+		{
+			best_ticks = ticks;
+			best = cand[idx];
+		}
+	}
+
+	SDHC_ADMA_mode = adma;
+	host_wml_set(best);
+
+	printf("WML calibrated to %d words at %d kHz.\n", best, host_clock_khz());
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Read a sector range of any size
+ *
+ * Unlike card_data_read() the size is not limited by an int byte count or
+ * a 32 bit byte offset, so whole partitions load with one call.
+ *
+ * @param dst_ptr      Pointer for data destination
+ * @param lba          First sector
+ * @param count        Number of sectors
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_sect_read(int *dst_ptr, uint32_t lba, uint32_t count)
+{
+	printf("card_sect_read: Read %u sectors from sector 0x%x to 0x%x.\n",
+	       count, lba, (int)dst_ptr);
+
+	if (card_wbuf_dirty(lba, count) && (card_wbuf_sync() == FAIL))
+	{
+		return FAIL;
+	}
+
+	if (card_blk_xfer(READ, (uint8_t *) dst_ptr, lba, count, BLK_LEN) == FAIL)
+	{
+		printf("Fail to read data from card.\n");
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Write a sector range of any size
+ *
+ * @param src_ptr      Pointer for data source
+ * @param lba          First sector
+ * @param count        Number of sectors
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_sect_write(int *src_ptr, uint32_t lba, uint32_t count)
+{
+	printf("card_sect_write: Write %u sectors from 0x%x to sector 0x%x.\n",
+	       count, (int)src_ptr, lba);
+
+	card_wbuf_invalidate(lba, count);
+
+	if (card_blk_xfer(WRITE, (uint8_t *) src_ptr, lba, count, BLK_LEN) == FAIL)
+	{
+		printf("Fail to write data to card.\n");
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Finish the active asynchronous request
+ *
+ * With a callback the slot is released once the callback returns; the
+ * callback may submit the next request into another slot. Otherwise the
+ * status is kept for card_async_poll().
+ *
+ * @param slot         Slot of the request
+ * @param status       0 if successful; 1 otherwise
+ */
+static void card_async_finish(int slot, int status)
+{
+	card_slot_t *sl = &async_slot[slot];
+
+	if ((status == SUCCESS) && (sl->req.dir == WRITE))
+	{
+		card_stats_write(sl->req.lba, sl->req.length / BLK_LEN);
+	}
+
+	sl->status = status;
+
+	if (sl->req.done)
+	{
+		sl->req.done(sl->req.ctx, status);
+		sl->used = FALSE;
+	}
+}
+
+/*!
+ * @brief Step the asynchronous engine: poll the active request, start the next
+ */
+static void card_async_run(void)
+{
+	int idx, next = -1;
+
+	if (async_active >= 0)
+	{
+		host_xfer_poll(&async_xfer);
+
+		if ((async_xfer.state != XFER_DONE) && (async_xfer.state != XFER_ERROR))
+		{
+			return;
+		}
+
+		idx = async_active;
+		async_active = -1;
+		card_async_finish(idx, (async_xfer.state == XFER_DONE) ? SUCCESS : FAIL);
+
+		/* A callback that submitted has already started the next request */
+		if (async_active >= 0)
+		{
+			return;
+		}
+	}
+
+	/* Oldest queued request goes next, the active one stays REQ_PENDING */
+	for (idx = 0; idx < CARD_ASYNC_DEPTH; idx++)
+	{
+		if (async_slot[idx].used && (async_slot[idx].status == REQ_PENDING) &&
+		    (idx != async_active) &&
+		    ((next < 0) || ((int)(async_slot[idx].seq - async_slot[next].seq) < 0)))
+		{
+			next = idx;
+		}
+	}
+
+	if (next >= 0)
+	{
+		async_active = next;
+
+		if (card_blk_start(&async_xfer, async_slot[next].req.dir, async_slot[next].req.buf,
+				   async_slot[next].req.lba, async_slot[next].req.length) == FAIL)
+		{
+			async_active = -1;
+			card_async_finish(next, FAIL);
+		}
+	}
+}
+
+/*!
+ * @brief Check whether an asynchronous request is active or queued
+ *
+ * @return             TRUE if a request has not finished yet; FALSE otherwise
+ */
+int card_async_pending(void)
+{
+	int idx;
+
+	if (async_active >= 0)
+	{
+		return TRUE;
+	}
+
+	for (idx = 0; idx < CARD_ASYNC_DEPTH; idx++)
+	{
+		if (async_slot[idx].used && (async_slot[idx].status == REQ_PENDING))
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*!
+ * @brief Run the asynchronous engine until no request is active or queued
+ *
+ * Blocking transfers call this first, the controller runs one command at a time.
+ */
+static void card_async_idle(void)
+{
+	while (card_async_pending())
+	{
+		card_async_run();
+	}
+}
+
+/*!
+ * @brief Queue a read or write and return without waiting for it
+ *
+ * Requests run in submission order. Progress is made from card_async_poll()
+ * and card_async_wait(); the caller can do other work between polls. A
+ * request with a callback reports only there, its handle is not polled.
+ *
+ * @param req          Request descriptor, copied
+ *
+ * @return             Handle of the request; -1 if it could not be queued
+ */
+int card_async_submit(card_req_t *req)
+{
+	uint32_t sectors = DIV_ROUND_UP(req->length, BLK_LEN);
+	int idx;
+
+	if (card_init_ready() == FAIL)
+	{
+		return -1;
+	}
+
+	if (sdhc_device.asleep)
+	{
+		printf("Card asleep, wake it first.\n");
+		return -1;
+	}
+
+	/* A CMD18/CMD25 with no blocks would never end */
+	if (req->length <= 0)
+	{
+		printf("Request has no data.\n");
+		return -1;
+	}
+
+	if ((req->dir == WRITE) && ((req->length % BLK_LEN) != 0))
+	{
+		printf("Write length must be a multiple of %d.\n", BLK_LEN);
+		return -1;
+	}
+
+	if (sectors > CARD_CHUNK_SECTORS)
+	{
+		printf("Request over %d sectors, split it.\n", CARD_CHUNK_SECTORS);
+		return -1;
+	}
+
+	/* Keep the write buffer coherent with the request */
+	if (req->dir == READ)
+	{
+		if (card_wbuf_dirty(req->lba, sectors) && (card_wbuf_sync() == FAIL))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		card_wbuf_invalidate(req->lba, sectors);
+	}
+
+	for (idx = 0; idx < CARD_ASYNC_DEPTH; idx++)
+	{
+		if (!async_slot[idx].used)
+		{
+			break;
+		}
+	}
+
+	if (idx == CARD_ASYNC_DEPTH)
+	{
+		printf("Asynchronous queue full.\n");
+		return -1;
+	}
+
+	async_slot[idx].req = *req;
+	async_slot[idx].seq = async_seq++;
+	async_slot[idx].status = REQ_PENDING;
+	async_slot[idx].used = TRUE;
+
+	card_async_run();
+
+	return idx;
+}
+
+/*!
+ * @brief Make progress and check a request
+ *
+ * Once a final status is returned the handle is released.
+ *
+ * @param handle       Handle from card_async_submit()
+ *
+ * @return             REQ_PENDING while in flight; 0 if successful; 1 otherwise
+ */
+int card_async_poll(int handle)
+{
+	int status;
+
+	if ((handle < 0) || (handle >= CARD_ASYNC_DEPTH) || !async_slot[handle].used)
+	{
+		return FAIL;
+	}
+
+	if (async_slot[handle].req.done)
+	{
+		printf("Request %d completes through its callback.\n", handle);
+		return FAIL;
+	}
+
+	card_async_run();
+
+	status = async_slot[handle].status;
+
+	if (status != REQ_PENDING)
+	{
+		async_slot[handle].used = FALSE;
+	}
+
+	return status;
+}
+
+/*!
+ * @brief Wait for a request to finish
+ *
+ * @param handle       Handle from card_async_submit()
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_async_wait(int handle)
+{
+	int status;
+
+	while ((status = card_async_poll(handle)) == REQ_PENDING)
+	{
+		;
+	}
+
+	return status;
+}
+
+/*!
+ * @brief Read data from any byte offset
+ *
+ * A start inside a sector is read through read_sector, the rest goes
+ * straight to the destination.
+ *
+ * @param dst_ptr      Pointer for data destination
+ * @param length       Data length in bytes
+ * @param offset       Card byte offset
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_data_read(int *dst_ptr, int length, uint32_t offset)
+{
+	uint8_t *dst = (uint8_t *) dst_ptr;
+	uint32_t lba = offset / BLK_LEN;
+	uint32_t skip = offset % BLK_LEN;
+	int part;
+
+	printf("card_data_read: Read 0x%x bytes from offset 0x%x to 0x%x.\n",
+	       length, offset, (int)dst_ptr);
+
+	/* Buffered writes to the range go out first */
+	if (card_wbuf_dirty(lba, DIV_ROUND_UP(skip + length, BLK_LEN)) && (card_wbuf_sync() == FAIL))
+	{
+		return FAIL;
+	}
+
+	if ((skip != 0) && (length > 0))
+	{
+		part = ((int) (BLK_LEN - skip) < length) ? (int) (BLK_LEN - skip) : length;
+
+		if (card_blk_read((int *) read_sector, lba, BLK_LEN) == FAIL)
+		{
+			return FAIL;
+		}
+
+		memcpy(dst, read_sector + skip, part);
+		dst += part;
+		length -= part;
+		lba++;
+	}
+
+	if ((length != 0) && (card_blk_read((int *) dst, lba, length) == FAIL))
+	{
+		return FAIL;
+	}
+
+	printf("card_data_read: Data read successful.\n");
+
+	return SUCCESS;
+}
+
+static void card_sha256_hook(void *ctx, const uint8_t *buf, int len)
+{
+	sha256_update((sha256_context *) ctx, buf, len);
+}
+
+static void card_crc32_hook(void *ctx, const uint8_t *buf, int len)
+{
+	*(uint32_t *) ctx = crc32(*(uint32_t *) ctx, buf, len);
+}
+
+/*!
+ * @brief Read data and digest it on the fly
+ *
+ * Each burst is hashed right after it leaves the FIFO, while it is still
+ * in cache, so no second pass over the image is needed.
+ *
+ * @param dst_ptr      Pointer for data destination
+ * @param length       Data length in bytes
+ * @param offset       Card byte offset, multiple of BLK_LEN
+ * @param type         DIGEST_SHA256 or DIGEST_CRC32
+ * @param digest       SHA256_SUM_LEN bytes, or 4 bytes big endian CRC32
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int card_data_read_digest(int *dst_ptr, int length, uint32_t offset,
+			  digest_type_t type, uint8_t *digest)
+{
+	sha256_context sha;
+	uint32_t crc = 0;
+	uint32_t lba = offset / BLK_LEN;
+	int status;
+
+	printf("card_data_read_digest: Read 0x%x bytes from offset 0x%x to 0x%x.\n",
+	       length, offset, (int)dst_ptr);
+
+	if ((offset % BLK_LEN) != 0)
+	{
+		printf("Digest offset must be a multiple of %d.\n", BLK_LEN);
+		return FAIL;
+	}
+
+	if (card_wbuf_dirty(lba, DIV_ROUND_UP(length, BLK_LEN)) && (card_wbuf_sync() == FAIL))
+	{
+		return FAIL;
+	}
+
+	/* Queued reads would go through the hook too */
+	card_async_idle();
+
+	if (type == DIGEST_SHA256)
+	{
+		sha256_starts(&sha);
+		host_set_data_hook(card_sha256_hook, &sha);
+	}
+	else
+	{
+		host_set_data_hook(card_crc32_hook, &crc);
+	}
+
+	status = card_blk_read(dst_ptr, lba, length);
+
+	host_set_data_hook(NULL, NULL);
+
+	if (status == FAIL)
+	{
+		return FAIL;
+	}
+
+	if (type == DIGEST_SHA256)
+	{
+		sha256_finish(&sha, digest);
+	}
+	else
+	{
+		digest[0] = crc >> 24;
+		digest[1] = crc >> 16;
+		digest[2] = crc >> 8;
+		digest[3] = crc;
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Write whole sectors to the card with CMD25
+ *
+ * Buffered data for the same sectors is dropped, this write is newer.
+ *
+ * @param src_ptr      Pointer for data source
+ * @param length       Data length in bytes, multiple of BLK_LEN
+ * @param offset       Card byte offset, multiple of BLK_LEN
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_data_write(int *src_ptr, int length, uint32_t offset)
+{
+	uint32_t lba = offset / BLK_LEN;
+
+	printf("card_data_write: Write 0x%x bytes from 0x%x to offset 0x%x.\n",
+	       length, (int)src_ptr, offset);
+
+	if (((length % BLK_LEN) != 0) || ((offset % BLK_LEN) != 0))
+	{
+		printf("Write offset and length must be multiples of %d.\n", BLK_LEN);
+		return FAIL;
+	}
+
+	card_wbuf_invalidate(lba, length / BLK_LEN);
+
+	if (card_blk_write(src_ptr, lba, length) == FAIL)
+	{
+		return FAIL;
+	}
+
+	printf("card_data_write: Data write successful.\n");
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Stream an image through a consumer chunk by chunk
+ *
+ * The card is read into a ring of STREAM_RING_DEPTH chunk buffers. Chunk
+ * N + 1 is submitted before chunk N is handed to the consumer, so
+ * decompression overlaps the transfer instead of following the whole image.
+ *
+ * @param offset       Card byte offset, multiple of BLK_LEN
+ * @param length       Image length in bytes
+ * @param fn           Consumer called for every chunk in order
+ * @param ctx          Context passed to the consumer
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int card_stream_read(uint32_t offset, int length, stream_fn_t fn, void *ctx)
+{
+	card_req_t req;
+	int done, len, cur, next = -1, slot = 0;
+
+	printf("card_stream_read: Stream 0x%x bytes from offset 0x%x.\n", length, offset);
+
+	if (length <= 0)
+	{
+		return SUCCESS;
+	}
+
+	if ((offset % BLK_LEN) != 0)
+	{
+		printf("Stream offset must be a multiple of %d.\n", BLK_LEN);
+		return FAIL;
+	}
+
+	req.dir = READ;
+	req.done = NULL;
+	req.ctx = NULL;
+
+	/* Chunk 0 */
+	req.buf = stream_ring[slot];
+	req.lba = offset / BLK_LEN;
+	req.length = (length > (STREAM_CHUNK_SECTORS * BLK_LEN)) ? (STREAM_CHUNK_SECTORS * BLK_LEN) : length;
+	cur = card_async_submit(&req);
+
+	for (done = 0; done < length; done += len)
+	{
+		len = length - done;
+		if (len > (STREAM_CHUNK_SECTORS * BLK_LEN))
+		{
+			len = STREAM_CHUNK_SECTORS * BLK_LEN;
+		}
+
+		if ((cur < 0) || (card_async_wait(cur) == FAIL))
+		{
+			return FAIL;
+		}
+
+		/* Next chunk transfers while this one is consumed */
+		next = -1;
+		if ((done + len) < length)
+		{
+			req.buf = stream_ring[(slot + 1) % STREAM_RING_DEPTH];
+			req.lba = (offset + done + len) / BLK_LEN;
+			req.length = length - (done + len);
+			if (req.length > (STREAM_CHUNK_SECTORS * BLK_LEN))
+			{
+				req.length = STREAM_CHUNK_SECTORS * BLK_LEN;
+			}
+			next = card_async_submit(&req);
+		}
+
+		if (fn(ctx, (uint8_t *) stream_ring[slot], len) != SUCCESS)
+		{
+			printf("Stream consumer stopped at 0x%x.\n", done);
+			if (next >= 0)
+			{
+				card_async_wait(next);
+			}
+			return FAIL;
+		}
+
+		cur = next;
+		slot = (slot + 1) % STREAM_RING_DEPTH;
+	}
+
+	return SUCCESS;
+}
+
+/* Test, set and clear one sector bit in a write buffer map */
+static int wbuf_test(uint32_t *map, int idx)
+{
+	return (map[idx / 32] >> (idx % 32)) & 1;
+}
+
+static void wbuf_set(uint32_t *map, int idx)
+{
+	map[idx / 32] |= (1U << (idx % 32));
+}
+
+static void wbuf_clr(uint32_t *map, int idx)
+{
+	map[idx / 32] &= ~(1U << (idx % 32));
+}
+
+/*!
+ * @brief Check whether a sector range has dirty data in the write buffer
+ *
+ * @param lba          First sector
+ * @param count        Number of sectors
+ *
+ * @return             TRUE if any sector is dirty
+ */
+static int card_wbuf_dirty(uint32_t lba, uint32_t count)
+{
+	uint32_t idx;
+
+	if (!wbuf.active || (wbuf.dirty_cnt == 0))
+	{
+		return FALSE;
+	}
+
+	for (idx = 0; idx < WBUF_SECTORS; idx++)
+	{
+		if (((wbuf.base + idx) >= lba) && ((wbuf.base + idx) < (lba + count)) &&
+		    wbuf_test(wbuf.dirty, idx))
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*!
+ * @brief Drop buffered data for sectors written or erased behind the buffer
+ *
+ * @param lba          First sector
+ * @param count        Number of sectors
+ */
+static void card_wbuf_invalidate(uint32_t lba, uint32_t count)
+{
+	uint32_t idx;
+
+	if (!wbuf.active)
+	{
+		return;
+	}
+
+	for (idx = 0; idx < WBUF_SECTORS; idx++)
+	{
+		if (((wbuf.base + idx) >= lba) && ((wbuf.base + idx) < (lba + count)))
+		{
+			if (wbuf_test(wbuf.dirty, idx))
+			{
+				wbuf_clr(wbuf.dirty, idx);
+				wbuf.dirty_cnt--;
+			}
+
+			wbuf_clr(wbuf.valid, idx);
+		}
+	}
+}
+
+/*!
+ * @brief Write all dirty sectors of the buffer back to the card
+ *
+ * Each run of dirty sectors goes out as one CMD25. Runs are cut at erase
+ * group boundaries so no write straddles two groups.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_wbuf_sync(void)
+{
+	uint32_t grp = sdhc_device.erase_grp_size;
+	int idx, start = -1;
+
+	if (!wbuf.active || (wbuf.dirty_cnt == 0))
+	{
+		return SUCCESS;
+	}
+
+	printf("card_wbuf_sync: %d dirty sectors at 0x%x.\n", wbuf.dirty_cnt, wbuf.base);
+
+	for (idx = 0; idx <= WBUF_SECTORS; idx++)
+	{
+		if ((start >= 0) &&
+		    ((idx == WBUF_SECTORS) || !wbuf_test(wbuf.dirty, idx) ||
+		     ((grp != 0) && (((wbuf.base + idx) % grp) == 0))))
+		{
+			if (card_blk_write(&wbuf_data[start * (BLK_LEN / FOUR)], wbuf.base + start,
+					   (idx - start) * BLK_LEN) == FAIL)
+			{
+				return FAIL;
+			}
+
+			start = -1;
+		}
+
+		if ((idx < WBUF_SECTORS) && (start < 0) && wbuf_test(wbuf.dirty, idx))
+		{
+			start = idx;
+		}
+	}
+
+	memset(wbuf.dirty, 0, sizeof(wbuf.dirty));
+	wbuf.dirty_cnt = 0;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Write through the coalescing buffer
+ *
+ * Data is staged in an aligned window of WBUF_SECTORS sectors. A partial
+ * sector is filled from the card once, later writes to it stay in RAM.
+ * The window goes back to the card when WBUF_FLUSH_SECTORS sectors are
+ * dirty, when a write lands outside it, or on card_wbuf_sync().
+ *
+ * @param src_ptr      Pointer for data source
+ * @param length       Data length in bytes, any size
+ * @param offset       Card byte offset, any alignment
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_wbuf_write(int *src_ptr, int length, uint32_t offset)
+{
+	uint8_t *src = (uint8_t *) src_ptr;
+	uint8_t *buf = (uint8_t *) wbuf_data;
+	uint32_t lba, win, sect_off, len;
+	int idx;
+
+	while (length > 0)
+	{
+		lba = offset / BLK_LEN;
+		sect_off = offset % BLK_LEN;
+		win = (lba / WBUF_SECTORS) * WBUF_SECTORS;
+
+		/* Moving to another window writes the current one back */
+		if (!wbuf.active || (wbuf.base != win))
+		{
+			if (card_wbuf_sync() == FAIL)
+			{
+				return FAIL;
+			}
+
+			memset(wbuf.valid, 0, sizeof(wbuf.valid));
+			wbuf.base = win;
+			wbuf.active = TRUE;
+		}
+
+		idx = lba - wbuf.base;
+		len = BLK_LEN - sect_off;
+		if (len > length)
+		{
+			len = length;
+		}
+
+		/* Fill the rest of a partial sector from the card once */
+		if ((len != BLK_LEN) && !wbuf_test(wbuf.valid, idx))
+		{
+			if (card_blk_read(&wbuf_data[idx * (BLK_LEN / FOUR)], lba, BLK_LEN) == FAIL)
+			{
+				return FAIL;
+			}
+		}
+
+		memcpy(buf + (idx * BLK_LEN) + sect_off, src, len);
+		wbuf_set(wbuf.valid, idx);
+
+		if (!wbuf_test(wbuf.dirty, idx))
+		{
+			wbuf_set(wbuf.dirty, idx);
+			wbuf.dirty_cnt++;
+		}
+
+		src += len;
+		offset += len;
+		length -= len;
+
+		if ((wbuf.dirty_cnt >= WBUF_FLUSH_SECTORS) && (card_wbuf_sync() == FAIL))
+		{
+			return FAIL;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Write scheduler aligned on the card's optimal write size
+ *
+ * Whole optimal write units in the request go straight to the card, one
+ * multi-block command per erase group. The unaligned head and tail are
+ * batched in the coalescing buffer, where they meet the leftovers of
+ * neighbouring requests.
+ *
+ * @param src_ptr      Pointer for data source
+ * @param length       Data length in bytes, any size
+ * @param offset       Card byte offset, any alignment
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int card_sched_write(int *src_ptr, int length, uint32_t offset)
+{
+	uint8_t *src = (uint8_t *) src_ptr;
+	uint32_t unit = sdhc_device.opt_write_size;
+	uint32_t grp = sdhc_device.erase_grp_size;
+	uint32_t first, last, lba, cnt;
+
+	if (unit == 0)
+	{
+		unit = ONE;
+	}
+
+	/* Whole units inside the request: sectors first to last - 1 */
+	first = (offset / BLK_LEN) + (((offset % BLK_LEN) != 0) ? 1 : 0);
+	first = ((first + unit - 1) / unit) * unit;
+	last = (((offset + length) / BLK_LEN) / unit) * unit;
+
+	if (first >= last)
+	{
+		return card_wbuf_write(src_ptr, length, offset);
+	}
+
+	if ((first * BLK_LEN) > offset)
+	{
+		if (card_wbuf_write(src_ptr, (first * BLK_LEN) - offset, offset) == FAIL)
+		{
+			return FAIL;
+		}
+	}
+
+	for (lba = first; lba < last; lba += cnt)
+	{
+		cnt = last - lba;
+
+		if ((grp != 0) && (cnt > (grp - (lba % grp))))
+		{
+			cnt = grp - (lba % grp);
+		}
+
+		card_wbuf_invalidate(lba, cnt);
+
+		if (card_blk_write((int *)(src + (lba * BLK_LEN) - offset), lba, cnt * BLK_LEN) == FAIL)
+		{
+			return FAIL;
+		}
+	}
+
+	if ((offset + length) > (last * BLK_LEN))
+	{
+		return card_wbuf_write((int *)(src + (last * BLK_LEN) - offset),
+				       (offset + length) - (last * BLK_LEN), last * BLK_LEN);
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Print traffic statistics
+ */
+void card_print_stats(void)
+{
+	sdhc_stats_t *st = &sdhc_device.stats;
+	uint32_t pct = 0;
+
+	if (st->wr_sectors != 0)
+	{
+		pct = (st->wr_sectors < 0x01000000) ? ((st->wr_aligned * 100) / st->wr_sectors) :
+		      (st->wr_aligned / (st->wr_sectors / 100));
+	}
+
+	printf("\tWrites: %d commands, %d sectors, %d%% in whole %d sector units\n",
+	       st->wr_cmds, st->wr_sectors, pct, sdhc_device.opt_write_size);
+	printf("\tTrims: %d commands, %d on whole %d sector units\n",
+	       st->trim_cmds, st->trim_aligned, sdhc_device.opt_trim_size);
+	printf("\tRetries: %d transfers resumed after a data error\n", st->retries);
+	printf("\tBus: %s, %d steps down, %d steps up\n",
+	       (sdhc_device.card_type == CARD_SD) ? sd_bus_level_name(sdhc_device.bus_level) :
+	       mmc_bus_level_name(sdhc_device.bus_level), st->bus_downs, st->bus_ups);
+	printf("\tBKOPS: %d runs%s, %d operations interrupted with HPI\n", st->bkops_runs,
+	       sdhc_device.bkops_running ? ", running" : "", st->hpi);
+}
+
+/*!
+ * @brief Timestamp the end of an init phase
+ *
+ * The time goes into the boot profile of sdhc_device and into bootstage,
+ * which hands it on to the kernel with the rest of the boot records.
+ *
+ * @param phase        Phase that just ended
+ */
+void card_mark_phase(card_phase_t phase)
+{
+	sdhc_device.phase_us[phase] = timer_get_us() - sdhc_device.phase_base;
+	sdhc_device.phase_seen |= (1 << phase);
+
+	bootstage_mark_name(BOOTSTAGE_ID_ALLOC, card_phase_names[phase]);
+}
+
+/*!
+ * @brief Print the boot profile of the last init
+ */
+void card_print_init_times(void)
+{
+	uint32_t prev = 0;
+	int phase;
+
+	printf("\t%-18s %10s %10s\n", "Phase", "at us", "took us");
+
+	for (phase = 0; phase < PHASE_COUNT; phase++)
+	{
+		if (!(sdhc_device.phase_seen & (1 << phase)))
+		{
+			continue;
+		}
+
+		printf("\t%-18s %10d %10d\n", card_phase_names[phase],
+		       sdhc_device.phase_us[phase], sdhc_device.phase_us[phase] - prev);
+
+		prev = sdhc_device.phase_us[phase];
+	}
+}
+
+/*!
+ * @brief Sort erase ranges by start sector and merge overlapping or adjacent ones
+ *
+ * @param ranges       Ranges to sort, rewritten in place
+ * @param count        Number of ranges
+ * 
+ * @return             Number of ranges left after merging
+ */
+static int card_coalesce_ranges(erase_range_t *ranges, int count)
+{
+	erase_range_t tmp;
+	int idx, itr, out;
+
+	/* Insertion sort, range lists are short */
+	for (idx = 1; idx < count; idx++)
+	{
+		tmp = ranges[idx];
+		for (itr = idx; (itr > 0) && (ranges[itr - 1].lba > tmp.lba); itr--)
+		{
+			ranges[itr] = ranges[itr - 1];
+		}
+		ranges[itr] = tmp;
+	}
+
+	out = 0;
+	for (idx = 0; idx < count; idx++)
+	{
+		if (ranges[idx].count == 0)
+		{
+			continue;
+		}
+
+		if ((out > 0) && (ranges[idx].lba <= (ranges[out - 1].lba + ranges[out - 1].count)))
+		{
+			if ((ranges[idx].lba + ranges[idx].count) > (ranges[out - 1].lba + ranges[out - 1].count))
+			{
+				ranges[out - 1].count = ranges[idx].lba + ranges[idx].count - ranges[out - 1].lba;
+			}
+		}
+		else
+		{
+			ranges[out++] = ranges[idx];
+		}
+	}
+
+	return out;
+}
+
+/*!
+ * @brief Busy timeout of a trim or discard
+ *
+ * The TRIM_MULT time applies to every erase group the range touches.
+ *
+ * @param lba          First sector
+ * @param count        Number of sectors
+ *
+ * @return             Timeout in ms
+ */
+static int card_trim_timeout(uint32_t lba, uint32_t count)
+{
+	uint32_t grp = sdhc_device.erase_grp_size;
+
+	return (((lba + count - 1) / grp) - (lba / grp) + 1) * sdhc_device.trim_timeout;
+}
+
+/*!
+ * @brief Send one CMD35/CMD36/CMD38 erase sequence and wait for busy end
+ *
+ * ERASE_PARAM and WP_ERASE_SKIP are found while the card erases, so the
+ * status is read again once busy ends.
+ *
+ * @param lba          First sector
+ * @param count        Number of sectors
+ * @param arg          CMD38 argument: erase, trim or discard
+ * @param timeout_ms   Busy timeout
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_erase_cmd(uint32_t lba, uint32_t count, uint32_t arg, int timeout_ms)
+{
+	command_response_t response;
+	uint32_t r1 = 0;
+	int sd = (sdhc_device.card_type == CARD_SD);
+
+	if (card_init_ready() == FAIL)
+	{
+		return FAIL;
+	}
+
+	if (sdhc_device.asleep)
+	{
+		printf("Card asleep, wake it first.\n");
+		return FAIL;
+	}
+
+	card_async_idle();
+
+	if (sdhc_device.bkops_running && (mmc_bkops_finish() == FAIL))
+	{
+		return FAIL;
+	}
+
+	/* SD takes the range with CMD32/33, eMMC with CMD35/36 */
+	if (host_send_fast_cmd(sd ? FAST_CMD32 : FAST_CMD35, card_blk_addr(lba)) == FAIL)
+	{
+		printf("Fail to send %s.\n", sd ? "CMD32" : "CMD35");
+		return FAIL;
+	}
+
+	if (host_send_fast_cmd(sd ? FAST_CMD33 : FAST_CMD36, card_blk_addr(lba + count - 1)) == FAIL)
+	{
+		printf("Fail to send %s.\n", sd ? "CMD33" : "CMD36");
+		return FAIL;
+	}
+
+	card_set_dto(DTO_ERASE, timeout_ms);
+
+	if (host_send_fast_cmd(FAST_CMD38, arg) == FAIL)
+	{
+		printf("Fail to send CMD38.\n");
+		return FAIL;
+	}
+
+	if (host_wait_busy(timeout_ms) == FAIL)
+	{
+		return FAIL;
+	}
+
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	if (response.cmd_rsp0 & R1_ERASE_ERRORS)
+	{
+		printf("Erase error, card status 0x%x\n", response.cmd_rsp0);
+		return FAIL;
+	}
+
+	if ((card_send_status(&r1) == FAIL) || (r1 & R1_ERASE_ERRORS) ||
+	    (CURR_CARD_STATE(r1) != TRAN))
+	{
+		printf("Erase error after busy, card status 0x%x\n", r1);
+		return FAIL;
+	}
+
+	if (arg != MMC_ERASE_ARG)
+	{
+		sdhc_device.stats.trim_cmds++;
+
+		if ((sdhc_device.opt_trim_size != 0) && ((lba % sdhc_device.opt_trim_size) == 0) &&
+		    ((count % sdhc_device.opt_trim_size) == 0))
+		{
+			sdhc_device.stats.trim_aligned++;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Erase a list of sector ranges
+ *
+ * Ranges are sorted and merged first. Whole erase groups are erased with
+ * ERASE, the unaligned head and tail of each range with TRIM or DISCARD.
+ * Partial groups are left alone if the card supports neither.
+ *
+ * @param ranges       Sector ranges, sorted and merged in place
+ * @param count        Number of ranges
+ * @param partial      Command for partial erase groups
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int card_erase(erase_range_t *ranges, int count, erase_partial_t partial)
+{
+	uint32_t grp = sdhc_device.erase_grp_size;
+	uint32_t start, end, head, tail, part_arg;
+	int idx, status = SUCCESS;
+
+	if (grp == 0)
+	{
+		printf("Erase group size unknown.\n");
+		return FAIL;
+	}
+
+	if ((partial == ERASE_PARTIAL_DISCARD) && (sdhc_device.erase_caps & ERASE_CAP_DISCARD))
+	{
+		part_arg = MMC_DISCARD_ARG;
+	}
+	else
+	{
+		part_arg = MMC_TRIM_ARG;
+	}
+
+	count = card_coalesce_ranges(ranges, count);
+
+	/* Buffered data for erased sectors is stale */
+	for (idx = 0; idx < count; idx++)
+	{
+		card_wbuf_invalidate(ranges[idx].lba, ranges[idx].count);
+	}
+
+	for (idx = 0; (idx < count) && (status == SUCCESS); idx++)
+	{
+		start = ranges[idx].lba;
+		end = start + ranges[idx].count;
+
+		if ((sdhc_device.sec_count != 0) && (end > sdhc_device.sec_count))
+		{
+			printf("Erase range 0x%x+0x%x out of card.\n", start, ranges[idx].count);
+			return FAIL;
+		}
+
+		head = ((start + grp - 1) / grp) * grp;
+		tail = (end / grp) * grp;
+
+		printf("card_erase: sectors 0x%x - 0x%x\n", start, end - 1);
+
+		if (head >= tail)
+		{
+			/* No whole group inside the range */
+			head = end;
+			tail = end;
+		}
+		else
+		{
+			status = card_erase_cmd(head, tail - head, MMC_ERASE_ARG,
+						((tail - head) / grp) * sdhc_device.erase_timeout);
+		}
+
+		if ((status == SUCCESS) && (start < head))
+		{
+			if (sdhc_device.erase_caps & ERASE_CAP_TRIM)
+			{
+				status = card_erase_cmd(start, head - start, part_arg,
+							card_trim_timeout(start, head - start));
+			}
+			else
+			{
+				printf("Trim not supported, sectors 0x%x - 0x%x kept.\n", start, head - 1);
+			}
+		}
+
+		if ((status == SUCCESS) && (tail < end))
+		{
+			if (sdhc_device.erase_caps & ERASE_CAP_TRIM)
+			{
+				status = card_erase_cmd(tail, end - tail, part_arg,
+							card_trim_timeout(tail, end - tail));
+			}
+			else
+			{
+				printf("Trim not supported, sectors 0x%x - 0x%x kept.\n", tail, end - 1);
+			}
+		}
+	}
+
+	return status;
+}
+
+/*!
+ * @brief Make written data durable before U-Boot hands over to the kernel
+ *
+ * Meant to be called from board_quiesce_devices().
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_emmc_quiesce(void)
+{
+	if (card_wbuf_sync() == FAIL)
+	{
+		return FAIL;
+	}
+
+	return mmc_cache_flush();
+}
+
+/*!
+ * @brief Put the card to sleep for a low power standby
+ *
+ * Buffered writes and the volatile cache reach the flash first, then the
+ * card is deselected and sent to SLEEP with CMD5. The board may switch
+ * VCC off once this returns, VCCQ has to stay. Host and card settings
+ * are kept in sdhc_device for card_emmc_awake().
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_emmc_sleep(void)
+{
+	command_t cmd;
+
+	if (sdhc_device.asleep)
+	{
+		return SUCCESS;
+	}
+
+	if (sdhc_device.card_type != CARD_EMMC)
+	{
+		printf("SD cards have no sleep command.\n");
+		return FAIL;
+	}
+
+	card_async_idle();
+
+	if ((card_emmc_quiesce() == FAIL) ||
+	    (sdhc_device.bkops_running && (mmc_bkops_finish() == FAIL)))
+	{
+		return FAIL;
+	}
+
+	/* CMD7 with RCA 0 deselects, no response */
+	card_cmd_config(&cmd, CMD7, NO_ARG, READ, RESPONSE_NONE, DATA_PRESENT_NONE, FALSE, FALSE);
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		printf("Fail to deselect card.\n");
+		return FAIL;
+	}
+
+	if (mmc_sleep_awake(TRUE) == FAIL)
+	{
+		return FAIL;
+	}
+
+	sdhc_device.asleep = TRUE;
+
+	printf("Card asleep.\n");
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Wake the card from card_emmc_sleep() straight into TRAN
+ *
+ * The controller gets its registers back from the shadow in case it lost
+ * power, then CMD5 and CMD7 bring the card back. The card keeps its RCA,
+ * bus width and timing, so nothing is enumerated again.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_emmc_awake(void)
+{
+	if (!sdhc_device.asleep)
+	{
+		return SUCCESS;
+	}
+
+	host_shadow_restore();
+
+	if ((mmc_sleep_awake(FALSE) == FAIL) || (card_enter_trans() == FAIL))
+	{
+		printf("Fail to wake card.\n");
+		return FAIL;
+	}
+
+	/* Neither CMD16 nor the FIFO are trusted across the sleep */
+	sdhc_device.blk_len = 0;
+	sdhc_device.fifo_clean = FALSE;
+	sdhc_device.asleep = FALSE;
+
+	printf("Card awake.\n");
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Start the card init without waiting for the card
+ *
+ * Resets the controller and starts the init clocks. The rest of the init
+ * runs in card_emmc_init_step(), so the board can go on with other work
+ * while the card powers up. A card that is already up gets its queued
+ * requests and buffered writes first; if they fail the init is refused.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_emmc_init_start(void)
+{
+	/* The arena is reset below, queued and buffered data go out first */
+	if (sdhc_device.init_state == INIT_DONE)
+	{
+		card_async_idle();
+
+		if (card_wbuf_sync() == FAIL)
+		{
+			printf("Write buffer still dirty, not reinitializing.\n");
+			return FAIL;
+		}
+	}
+	else if (wbuf.active && (wbuf.dirty_cnt != 0))
+	{
+		printf("Card not ready, dropping %d buffered sectors.\n", wbuf.dirty_cnt);
+	}
+
+	sdhc_device.init_state = INIT_FAILED;
+
+	/* Phases are timed from here */
+	sdhc_device.phase_base = timer_get_us();
+	sdhc_device.phase_seen = 0;
+	bootstage_mark_name(BOOTSTAGE_ID_ALLOC, "sdhc_init_start");
+
+	/* Nothing is known about the card or the FIFO yet */
+	sdhc_device.rca = 0;
+	sdhc_device.blk_len = 0;
+	sdhc_device.fifo_clean = FALSE;
+	host_wml_set(0);
+	sdhc_device.bus_level = BUS_LEGACY_1BIT;
+	sdhc_device.bus_level_max = BUS_LEGACY_1BIT;
+	sdhc_device.bus_xfers = 0;
+	sdhc_device.bus_errs = 0;
+	sdhc_device.bus_clean = 0;
+
+	/* Carve all controller buffers out of the arena */
+	sdhc_arena_reset();
+	host_dma_init();
+	if (card_buf_init() == FAIL)
+	{
+		return FAIL;
+	}
+
+	/* Software reset to host controller */
+	host_reset(SDHC_ONE_BIT_SUPPORT);
+	card_mark_phase(PHASE_HOST_RESET);
+
+	/* Enable Init Frequency */
+//	host_cfg_clock(INIT_FREQ);
+//	printf("Init frequency set.\n");
+
+	/* Init clocks run while the caller does other work */
+	host_init_begin();
+
+	sdhc_device.init_start = get_timer(0);
+	sdhc_device.init_state = INIT_CLOCKS;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Run the card init as far as it can go without waiting
+ *
+ * Call it from the main loop after card_emmc_init_start() until it stops
+ * returning REQ_PENDING. Waits for the init clocks and the card power-up
+ * are deadlines checked here, not delays. Identification runs in one go
+ * once the card is powered up.
+ *
+ * @return             REQ_PENDING while in progress; 0 if successful; 1 otherwise
+ */
+int card_emmc_init_step(void)
+{
+	int status;
+
+	switch (sdhc_device.init_state)
+	{
+	case INIT_CLOCKS:
+		if (get_timer(sdhc_device.init_start) < CARD_INIT_CLK_MS)
+		{
+			return REQ_PENDING;
+		}
+
+		host_init_end();
+		card_mark_phase(PHASE_INIT_CLOCKS);
+		printf("80 clocks sent.\n");
+
+		/* Enable Identification Frequency */
+//		host_cfg_clock(IDENTIFICATION_FREQ);
+//		printf("Ident frequency set.\n");
+
+		/* Issue Software Reset to card */
+		if (card_software_reset() == FAIL)
+		{
+			printf("CMD0 fail\n");
+			break;
+		}
+		printf("Card reset Successfully\n");
+
+		/* Software reset */
+		host_reset_line(0x02000000);
+		printf("Software reset done\n");
+		card_mark_phase(PHASE_CMD0);
+
+		/* SD 2.0 answers CMD8, eMMC and SD 1.x stay silent */
+		sdhc_device.sd_v2 = (sd_if_cond() == SUCCESS);
+		sdhc_device.card_type = sdhc_device.sd_v2 ? CARD_SD : CARD_EMMC;
+		card_mark_phase(PHASE_PROBE);
+		sdhc_device.init_polls = 0;
+
+		sdhc_device.init_start = get_timer(0);
+		sdhc_device.init_poll = sdhc_device.init_start - CARD_OCR_POLL_MS;
+		sdhc_device.init_state = INIT_OCR;
+		return REQ_PENDING;
+
+	case INIT_OCR:
+		if (get_timer(sdhc_device.init_poll) < CARD_OCR_POLL_MS)
+		{
+			return REQ_PENDING;
+		}
+
+		/* Voltage Validation, one CMD1 or ACMD41 per step */
+		sdhc_device.init_poll = get_timer(0);
+		sdhc_device.init_polls++;
+
+		if (sdhc_device.card_type == CARD_SD)
+		{
+			status = sd_ocr_poll(sdhc_device.sd_v2);
+		}
+		else
+		{
+			status = mmc_ocr_poll();
+		}
+
+		/* No answer to the first CMD1 either: SD 1.x, ACMD41 from now on */
+		if ((status == FAIL) && (sdhc_device.card_type == CARD_EMMC) &&
+		    (sdhc_device.init_polls == 1))
+		{
+			host_reset_line(0x02000000);
+			sdhc_device.card_type = CARD_SD;
+			return REQ_PENDING;
+		}
+
+		if (status == REQ_PENDING)
+		{
+			if (get_timer(sdhc_device.init_start) < CARD_OCR_TIMEOUT)
+			{
+				return REQ_PENDING;
+			}
+
+			printf("Card power up timeout\n");
+			break;
+		}
+
+		if (status == FAIL)
+		{
+			break;
+		}
+
+		printf("%s voltage validation success\n",
+		       (sdhc_device.card_type == CARD_SD) ? "SD" : "MMC");
+		card_mark_phase(PHASE_OCR);
+		sdhc_device.init_state = INIT_IDENT;
+		return REQ_PENDING;
+
+	case INIT_IDENT:
+		/* The data commands of the init itself pass card_init_ready() */
+		sdhc_device.init_busy = TRUE;
+
+		/* Card Initialization, ends in the fastest mode the card runs */
+		status = (sdhc_device.card_type == CARD_SD) ? sd_init() : emmc_init();
+
+		/* Optional, the default burst is fine unless the mode proves otherwise */
+		if ((status == SUCCESS) && sdhc_device.wml_cal)
+		{
+			card_wml_calibrate();
+		}
+
+		sdhc_device.init_busy = FALSE;
+
+		if (status == FAIL)
+		{
+			break;
+		}
+
+		printf("SDHC arena: %d of %d bytes used.\n",
+		       sdhc_device.arena.used, sdhc_device.arena.size);
+
+		sdhc_device.init_state = INIT_DONE;
+		card_mark_phase(PHASE_INIT_DONE);
+		return SUCCESS;
+
+	case INIT_DONE:
+		return SUCCESS;
+
+	default:
+		return FAIL;
+	}
+
+	sdhc_device.init_state = INIT_FAILED;
+
+	return FAIL;
+}
+
+/*!
+ * @brief Finish a card init started with card_emmc_init_start()
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int card_emmc_init_wait(void)
+{
+	int status;
+
+	while ((status = card_emmc_init_step()) == REQ_PENDING)
+	{
+		;
+	}
+
+	return status;
+}
+
+/*!
+ * @brief Make sure the card init has finished before a data command
+ *
+ * An init still running in the background is completed here. Only the
+ * identification step itself gets through before INIT_DONE.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int card_init_ready(void)
+{
+	switch (sdhc_device.init_state)
+	{
+	case INIT_DONE:
+		return SUCCESS;
+
+	case INIT_IDENT:
+		if (sdhc_device.init_busy)
+		{
+			return SUCCESS;
+		}
+		return card_emmc_init_wait();
+
+	case INIT_CLOCKS:
+	case INIT_OCR:
+		return card_emmc_init_wait();
+
+	default:
+		printf("Card not initialized.\n");
+		return FAIL;
+	}
+}
+
+int card_emmc_init(void)
+{
+	if (card_emmc_init_start() == FAIL)
+	{
+		return FAIL;
 	}
 
-	return init_status;
+	return card_emmc_init_wait();
 }
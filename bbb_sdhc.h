@@ -18,9 +18,93 @@
 
 #define BLK_LEN 512
 
+/* Write coalescing buffer window and flush threshold in sectors */
+#define WBUF_SECTORS 256
+#define WBUF_FLUSH_SECTORS WBUF_SECTORS
+
+/* Streaming loader chunk size in sectors and number of chunk buffers */
+#define STREAM_CHUNK_SECTORS 128
+#define STREAM_RING_DEPTH 2
+
+/* Largest block count of one CMD18 or CMD25, SD_BLK NBLK is 16 bits */
+#define CARD_CHUNK_SECTORS 0xFFFF
+
+/* Resumes of one transfer after data errors before giving up */
+#define CARD_XFER_RETRIES 3
+
+/*
+ * Bus speed ladder: step down after CARD_BUS_ERR_LIMIT errors within
+ * CARD_BUS_ERR_WINDOW transfers, try one step up after CARD_BUS_UP_XFERS
+ * error free transfers.
+ */
+#define CARD_BUS_ERR_LIMIT  3
+#define CARD_BUS_ERR_WINDOW 64
+#define CARD_BUS_UP_XFERS   4096
+
+/* Sectors read for each watermark candidate of the calibration pass */
+#define CARD_WML_CAL_SECTORS 64
+
+/* Incremental init: init clock time, CMD1 poll spacing and power-up limit in ms */
+#define CARD_INIT_CLK_MS  10
+#define CARD_OCR_POLL_MS  1
+#define CARD_OCR_TIMEOUT  1000
+
+/* Asynchronous requests queued or in flight */
+#define CARD_ASYNC_DEPTH 4
+
+/*
+ * Fixed arena for every buffer the controller touches: ADMA table, DMA
+ * bounce lines, write buffer, stream ring, unaligned read sector and
+ * EXT_CSD.
+ */
+#define SDHC_ARENA_SIZE (ALIGN(ADMA_DESC_COUNT * 8, ARCH_DMA_MINALIGN) + \
+			 ALIGN(DMA_HEAD_LEN, ARCH_DMA_MINALIGN) + \
+			 ALIGN(DMA_TAIL_LEN, ARCH_DMA_MINALIGN) + \
+			 (WBUF_SECTORS * BLK_LEN) + \
+			 (STREAM_RING_DEPTH * STREAM_CHUNK_SECTORS * BLK_LEN) + \
+			 BLK_LEN + \
+			 BLK_LEN)
+
+/* Status of an asynchronous request that has not finished */
+#define REQ_PENDING 2
+
 #define CARD_BUSY_BIT 0x80000000
 #define SDHC_FIFO_LENGTH (0x80)
 
+/* R1 card status bits */
+#define R1_OUT_OF_RANGE      0x80000000
+#define R1_ADDRESS_ERROR     0x40000000
+#define R1_ERASE_SEQ_ERROR   0x10000000
+#define R1_ERASE_PARAM       0x08000000
+#define R1_WP_VIOLATION      0x04000000
+#define R1_WP_ERASE_SKIP     0x00008000
+#define R1_ILLEGAL_COMMAND   0x00400000
+#define R1_SWITCH_ERROR      0x00000080
+#define R1_EXCEPTION_EVENT   0x00000040
+#define R1_ERASE_ERRORS      (R1_OUT_OF_RANGE | R1_ADDRESS_ERROR | R1_ERASE_SEQ_ERROR | \
+			      R1_ERASE_PARAM | R1_WP_VIOLATION | R1_WP_ERASE_SKIP)
+
+
+/*
+ * R1 bits that make an R1b command fall back to CMD13. SWITCH_ERROR is
+ * left out, it belongs to the switch before and is checked in the mmc layer.
+ */
+#define R1_BUSY_CMD_ERRORS   (R1_OUT_OF_RANGE | R1_ADDRESS_ERROR | R1_ILLEGAL_COMMAND)
+
+/* Data timeout floors in ms, and access time multiplier of the MMC spec */
+#define CARD_READ_TMO_MIN  100
+#define CARD_WRITE_TMO_MIN 250
+#define CARD_ACCESS_MULT   10
+
+/* CMD38 arguments */
+#define MMC_ERASE_ARG   0x00000000
+#define MMC_TRIM_ARG    0x00000001
+#define MMC_DISCARD_ARG 0x00000003
+
+/* Erase capabilities of the card */
+#define ERASE_CAP_TRIM    0x01
+#define ERASE_CAP_DISCARD 0x02
+
 /* MMC Defines */
 #define MMC_SWITCH_SETBW_ARG(bus_width) (unsigned int)(0x03b70001 | ((bus_width >> 2) << 8))
 #define MMC_HV_HC_OCR_VALUE 0x40FF8000
@@ -184,6 +268,94 @@ typedef struct {
     ddren_enable ddren;
 } command_t;
 
+typedef enum {
+    ERASE_PARTIAL_TRIM = 0,
+    ERASE_PARTIAL_DISCARD = 1
+} erase_partial_t;
+
+typedef enum {
+    DTO_READ = 0,
+    DTO_WRITE = 1,
+    DTO_ERASE = 2,
+    DTO_SWITCH = 3
+} dto_class_t;
+
+/* Bus speed ladder, slowest first */
+typedef enum {
+    BUS_LEGACY_1BIT = 0,
+    BUS_HS_4BIT = 1,
+    BUS_HS52_8BIT = 2,
+    BUS_DDR52_8BIT = 3,
+    BUS_LEVEL_COUNT
+} bus_level_t;
+
+/* Steps of the incremental card init */
+typedef enum {
+    INIT_OFF = 0,               //not started
+    INIT_CLOCKS = 1,            //init clocks running
+    INIT_OCR = 2,               //CMD1 polled until the card is powered up
+    INIT_IDENT = 3,             //identification and bus setup
+    INIT_DONE = 4,              //card ready for data
+    INIT_FAILED = 5
+} init_state_t;
+
+/* Card init phases of the boot profile, in the order they end */
+typedef enum {
+    PHASE_HOST_RESET = 0,       //controller reset, buffers carved
+    PHASE_INIT_CLOCKS = 1,      //init clocks stopped
+    PHASE_CMD0 = 2,             //card in IDLE
+    PHASE_PROBE = 3,            //CMD8 card type probe
+    PHASE_OCR = 4,              //card powered up
+    PHASE_IDENT = 5,            //CID and RCA
+    PHASE_CSD = 6,              //CSD read, card selected
+    PHASE_EXT_CSD = 7,          //EXT_CSD read, eMMC only
+    PHASE_CONFIG = 8,           //erase, cache, BKOPS and HPI set up
+    PHASE_BUS_MODE = 9,         //fastest working bus mode reached
+    PHASE_INIT_DONE = 10,       //init finished
+    PHASE_FIRST_DATA = 11,      //first data transfer after init
+    PHASE_COUNT
+} card_phase_t;
+
+typedef enum {
+    DIGEST_SHA256 = 0,
+    DIGEST_CRC32 = 1
+} digest_type_t;
+
+/* Consumer of a streamed chunk, e.g. a decompressor; returns 0 to go on */
+typedef int (*stream_fn_t)(void *ctx, const uint8_t *buf, int len);
+
+/* Completion callback of an asynchronous request */
+typedef void (*card_req_fn_t)(void *ctx, int status);
+
+typedef struct {
+    xfer_type_t dir;            //READ or WRITE
+    int *buf;                   //data buffer
+    int length;                 //data length in bytes
+    uint32_t lba;               //first sector
+    card_req_fn_t done;         //completion callback, NULL to poll
+    void *ctx;                  //context passed to the callback
+} card_req_t;
+
+typedef struct {
+    card_req_t req;             //request descriptor
+    unsigned int seq;           //submission order
+    int status;                 //REQ_PENDING, SUCCESS or FAIL
+    unsigned char used;         //slot holds a request
+} card_slot_t;
+
+typedef struct {
+    uint32_t lba;               //first sector of the range
+    uint32_t count;             //number of sectors
+} erase_range_t;
+
+typedef struct {
+    uint32_t base;              //first sector of the write buffer window
+    uint32_t dirty_cnt;         //number of dirty sectors
+    uint32_t valid[WBUF_SECTORS / 32];  //sectors holding card data
+    uint32_t dirty[WBUF_SECTORS / 32];  //sectors not yet on the card
+    unsigned char active;       //window holds data
+} wbuf_state_t;
+
 typedef struct {
     response_format_t format;
     unsigned int cmd_rsp0;
@@ -192,6 +364,33 @@ typedef struct {
     unsigned int cmd_rsp3;
 } command_response_t;
 
+typedef struct {
+    uint32_t wr_cmds;           //write commands issued
+    uint32_t wr_sectors;        //sectors written
+    uint32_t wr_aligned;        //sectors written in whole optimal write units
+    uint32_t trim_cmds;         //trim/discard commands issued
+    uint32_t trim_aligned;      //trim/discard commands on optimal trim units
+    uint32_t retries;           //transfers resumed after a data error
+    uint32_t bus_downs;         //bus speed steps down on errors
+    uint32_t bus_ups;           //bus speed steps back up
+    uint32_t bkops_runs;        //manual BKOPS started
+    uint32_t hpi;               //card operations interrupted with HPI
+} sdhc_stats_t;
+
+typedef struct {
+    uint32_t con;               //SD_CON
+    uint32_t hctl;              //SD_HCTL
+    uint32_t sysctl;            //SD_SYSCTL without ICS and reset bits
+    uint32_t ie;                //SD_IE
+    uint32_t cmd;               //last SD_CMD written
+} sdhc_shadow_t;
+
+typedef struct {
+    uint8_t *base;              //start of the pool, cache line aligned
+    uint32_t size;              //pool size in bytes
+    uint32_t used;              //bytes handed out
+} sdhc_arena_t;
+
 typedef struct {
     unsigned int reg_base;      //register base address
     unsigned int adma_ptr;      //ADMA buffer address
@@ -201,18 +400,109 @@ typedef struct {
     unsigned char addr_mode;    //addressing mode
     unsigned char intr_id;      //interrupt ID
     unsigned char status;       //interrupt status
+
+    unsigned int sec_count;     //user area size in sectors
+    unsigned int erase_grp_size;    //erase group size in sectors
+    unsigned int erase_timeout; //erase timeout per group in ms
+    unsigned int trim_timeout;  //trim/discard timeout per group in ms
+    unsigned char erase_caps;   //ERASE_CAP_* supported by the card
+
+    unsigned int switch_timeout;    //CMD6 busy timeout in ms
+    unsigned char switch_unchecked; //last CMD6 not checked for SWITCH_ERROR yet
+    uint32_t switch_arg;        //argument of that CMD6
+    unsigned int cache_size;    //volatile cache size in KB, 0 if none
+    unsigned char cache_en;     //turn the volatile cache on at init
+    unsigned char cache_on;     //volatile cache currently enabled
+
+    unsigned int opt_write_size;    //optimal write size in sectors
+    unsigned int opt_trim_size; //optimal trim size in sectors
+    sdhc_stats_t stats;         //traffic statistics
+    sdhc_arena_t arena;         //DMA safe buffer pool
+    sdhc_shadow_t shadow;       //control register shadow
+
+    unsigned int taac_ns;       //asynchronous read access time in ns
+    unsigned int nsac_clks;     //clock dependent read access time in clocks
+    unsigned char r2w_factor;   //write time is read time << r2w_factor
+
+    unsigned int blk_len;       //block length set with CMD16, 0 if unknown
+    unsigned char fifo_clean;   //FIFO known to hold no stale data
+
+    unsigned int wml;           //PIO burst in words, 0 for the default
+    unsigned int wml_mode;      //bus mode the burst was chosen for
+    unsigned char wml_cal;      //time the burst candidates at init
+
+    unsigned char bus_level;    //current bus_level_t
+    unsigned char bus_level_max;    //highest level the card supports
+    unsigned int bus_xfers;     //transfers in the current error window
+    unsigned int bus_errs;      //errors in the current error window
+    unsigned int bus_clean;     //error free transfers since the last step
+
+    unsigned char bkops_support;    //card supports manual BKOPS
+    unsigned char bkops_en;     //manual BKOPS enabled in EXT_CSD
+    unsigned char bkops_running;    //BKOPS started, the card may still be busy
+    unsigned char bkops_pending;    //BKOPS cut short by HPI, restart in idle time
+    unsigned char exception;    //R1 EXCEPTION_EVENT seen since the last check
+    unsigned int bkops_wr;      //sectors written since the last BKOPS check
+
+    unsigned char hpi_en;       //HPI enabled in EXT_CSD
+    unsigned char hpi_cmd12;    //HPI is sent as CMD12, CMD13 otherwise
+    unsigned int hpi_timeout;   //OUT_OF_INTERRUPT_TIME in ms
+
+    unsigned int sa_timeout;    //CMD5 sleep/awake timeout in ms
+    unsigned char asleep;       //card in SLEEP, deselected
+
+    unsigned char init_state;   //init_state_t of card_emmc_init_step()
+    unsigned int init_start;    //get_timer() base of the current init step
+    unsigned int init_poll;     //get_timer() of the last CMD1 or ACMD41
+    unsigned int init_polls;    //CMD1 or ACMD41 sent in this init
+    unsigned char init_busy;    //identification running, its own data commands pass
+
+    unsigned char card_type;    //card_type_e found by the probe
+    unsigned char sd_v2;        //SD card answered CMD8, ACMD41 asks for high capacity
+
+    uint32_t phase_base;        //timer_get_us() at the init start
+    uint32_t phase_seen;        //bit per card_phase_t reached in this init
+    uint32_t phase_us[PHASE_COUNT]; //end of each phase in us after phase_base
 } sdhc_inst_t;
 
 /* uSDHC device table */
 extern sdhc_inst_t sdhc_device;
 
 extern int card_emmc_init(void);
+extern int card_emmc_init_start(void);
+extern int card_emmc_init_step(void);
+extern int card_emmc_init_wait(void);
+extern void sdhc_arena_reset(void);
+extern void *sdhc_arena_alloc(uint32_t size);
 extern void card_cmd_config(command_t * cmd, int index, int argument, xfer_type_t transfer,
 			    response_format_t format, data_present_select data,
 			    crc_check_enable crc, cmdindex_check_enable cmdindex);
 extern int card_get_cid(void);
 extern int card_enter_trans(void);
 extern int card_trans_status(void);
+extern int card_set_blklen(int len);
+extern int card_busy_done(int timeout_ms);
+extern void card_set_dto(dto_class_t cls, unsigned int busy_ms);
 extern int card_data_read(int *dst_ptr, int length, uint32_t offset);
+extern int card_data_read_digest(int *dst_ptr, int length, uint32_t offset,
+				 digest_type_t type, uint8_t *digest);
+extern int card_data_write(int *src_ptr, int length, uint32_t offset);
+extern int card_sect_read(int *dst_ptr, uint32_t lba, uint32_t count);
+extern int card_sect_write(int *src_ptr, uint32_t lba, uint32_t count);
+extern int card_stream_read(uint32_t offset, int length, stream_fn_t fn, void *ctx);
+extern int card_async_submit(card_req_t *req);
+extern int card_async_poll(int handle);
+extern int card_async_wait(int handle);
+extern int card_async_pending(void);
+extern int card_erase(erase_range_t *ranges, int count, erase_partial_t partial);
+extern int card_emmc_quiesce(void);
+extern int card_emmc_sleep(void);
+extern int card_emmc_awake(void);
+extern int card_wbuf_write(int *src_ptr, int length, uint32_t offset);
+extern int card_wbuf_sync(void);
+extern int card_sched_write(int *src_ptr, int length, uint32_t offset);
+extern void card_print_stats(void);
+extern void card_mark_phase(card_phase_t phase);
+extern void card_print_init_times(void);
 
 #endif
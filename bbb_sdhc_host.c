@@ -14,46 +14,884 @@
 #include <post.h>
 #include <u-boot/sha256.h>
 
-static int sdhc_check_transfer(void);
+static int sdhc_check_transfer(unsigned int stat);
 int host_data_read(int *dst_ptr, int length, int wml);
+int host_data_write(int *src_ptr, int length, int wml);
 void host_read_response(command_response_t *response);
-static int sdhc_check_response(void);
-static void sdhc_wait_end_cmd_resp_intr(void);
+static int sdhc_check_response(unsigned int stat);
+static unsigned int sdhc_wait_end_cmd_resp_intr(void);
 static void sdhc_cmd_cfg(command_t *cmd);
+static void sdhc_cmd_issue(uint32_t word, uint32_t arg);
+int host_send_fast_cmd(fast_cmd_t id, uint32_t arg);
 static int sdhc_wait_cmd_data_lines(int data_present);
 int host_send_cmd(command_t * cmd);
+void host_init_begin(void);
+void host_init_end(void);
 void host_init_active(void);
 void host_cfg_clock(int frequency);
 static void sdhc_set_data_transfer_width(int dat_width);
 void host_set_bus_width(int bus_width);
+void host_set_bus_speed(unsigned int clkd, int hs, int ddr);
 void host_reset(int bus_width);
 void host_cfg_block(int blk_len, int nob);
+int host_wait_busy(int timeout_ms);
+int host_card_busy(void);
+unsigned int host_clock_khz(void);
+int host_set_data_timeout(uint32_t timeout_us, uint32_t timeout_clks);
+void host_set_data_hook(host_data_hook_t hook, void *ctx);
+int host_dma_init(void);
+static void sdhc_shadow_write(uint32_t *shadow, unsigned int reg, uint32_t clear, uint32_t set);
+void host_shadow_load(void);
+void host_shadow_restore(void);
+void host_reset_line(unsigned int mask);
+void host_set_irq(unsigned int mask);
+static int *sdhc_fifo_drain(int *dst, int words);
+static void sdhc_xfer_burst(host_xfer_t *xfer);
+static int sdhc_xfer_begin(host_xfer_t *xfer);
+int host_xfer_start(command_t *cmd, host_xfer_t *xfer);
+int host_xfer_start_fast(fast_cmd_t id, uint32_t arg, host_xfer_t *xfer);
+xfer_state_t host_xfer_poll(host_xfer_t *xfer);
+int host_xfer_wait(host_xfer_t *xfer);
+int host_xfer_abort(host_xfer_t *xfer, uint32_t *intact);
+static void sdhc_dma_split(host_xfer_t *xfer, uint32_t *head, uint32_t *body, uint32_t *tail);
+static int sdhc_dma_add(int idx, unsigned long addr, uint32_t len);
+static int sdhc_dma_map(host_xfer_t *xfer);
+static void sdhc_dma_unmap(host_xfer_t *xfer);
+
+/* Pre-encoded SD_CMD words, indexed by fast_cmd_t */
+static const uint32_t sdhc_fast_cmd[FAST_CMD_COUNT] = {
+	[FAST_CMD6]  = SDHC_CMD_WORD(CMD6, RESPONSE_48_CHECK_BUSY, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD7]  = SDHC_CMD_WORD(CMD7, RESPONSE_48_CHECK_BUSY, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD8]  = SDHC_CMD_WORD(CMD8, RESPONSE_48, DATA_PRESENT, READ, FALSE),
+	[FAST_CMD12] = SDHC_CMD_WORD(CMD12, RESPONSE_48_CHECK_BUSY, DATA_PRESENT_NONE, READ, FALSE) |
+		       BM_SDHC_CMD_CMD_TYPE,
+	[FAST_CMD13] = SDHC_CMD_WORD(CMD13, RESPONSE_48, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD16] = SDHC_CMD_WORD(CMD16, RESPONSE_48, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD18] = SDHC_CMD_WORD(CMD18, RESPONSE_48, DATA_PRESENT, READ, TRUE),
+	[FAST_CMD25] = SDHC_CMD_WORD(CMD25, RESPONSE_48, DATA_PRESENT, WRITE, TRUE),
+	[FAST_CMD32] = SDHC_CMD_WORD(CMD32, RESPONSE_48, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD33] = SDHC_CMD_WORD(CMD33, RESPONSE_48, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD35] = SDHC_CMD_WORD(CMD35, RESPONSE_48, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD36] = SDHC_CMD_WORD(CMD36, RESPONSE_48, DATA_PRESENT_NONE, READ, FALSE),
+	[FAST_CMD38] = SDHC_CMD_WORD(CMD38, RESPONSE_48_CHECK_BUSY, DATA_PRESENT_NONE, READ, FALSE),
+};
+
+/* Read data hook */
+static host_data_hook_t data_hook;
+static void *data_hook_ctx;
+
+/* ADMA2 descriptor table and bounce buffers for unaligned buffer ends */
+static uint32_t *adma_desc;
+static uint8_t *dma_head;
+static uint8_t *dma_tail;
+
+/*!
+ * @brief Take the ADMA2 table and bounce buffers from the device arena
+ *
+ * Without them every transfer falls back to PIO.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int host_dma_init(void)
+{
+	adma_desc = sdhc_arena_alloc(ADMA_DESC_COUNT * 8);
+	dma_head = sdhc_arena_alloc(DMA_HEAD_LEN);
+	dma_tail = sdhc_arena_alloc(DMA_TAIL_LEN);
+
+	if (!adma_desc || !dma_head || !dma_tail)
+	{
+		printf("No arena space for ADMA, using PIO.\n");
+		adma_desc = NULL;
+		sdhc_device.adma_ptr = 0;
+		return FAIL;
+	}
+
+	sdhc_device.adma_ptr = (unsigned int)(unsigned long) adma_desc;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Install a hook that sees every burst read from the FIFO
+ *
+ * @param hook         Hook function, NULL to remove
+ * @param ctx          Context passed to the hook
+ */
+void host_set_data_hook(host_data_hook_t hook, void *ctx)
+{
+	data_hook = hook;
+	data_hook_ctx = ctx;
+}
+
+/*!
+ * @brief Update a shadowed control register
+ *
+ * The new value comes from the shadow, not from the register, and the
+ * register is only written when the value changes.
+ *
+ * @param shadow       Shadow of the register
+ * @param reg          Register address
+ * @param clear        Bits to clear
+ * @param set          Bits to set
+ */
+static void sdhc_shadow_write(uint32_t *shadow, unsigned int reg, uint32_t clear, uint32_t set)
+{
+	uint32_t val = (*shadow & ~clear) | set;
+
+	if (val != *shadow)
+	{
+		*shadow = val;
+		__raw_writel(val, reg);
+	}
+}
+
+/*!
+ * @brief Reload the control register shadow from the controller
+ *
+ * Needed after anything that changes the registers behind the shadow's
+ * back, such as a full software reset.
+ */
+void host_shadow_load(void)
+{
+	sdhc_device.shadow.con = __raw_readl(0x481D812C);
+	sdhc_device.shadow.hctl = __raw_readl(0x481D8228);
+	sdhc_device.shadow.sysctl = __raw_readl(0x481D822C) & ~SDHC_SYSCTL_VOLATILE;
+	sdhc_device.shadow.ie = __raw_readl(0x481D8234);
+	sdhc_device.shadow.cmd = 0;
+}
+
+/*!
+ * @brief Write the control register shadow back to the controller
+ *
+ * Brings the controller back to the last configuration after it lost
+ * power in standby. The card clock is only enabled once the internal
+ * clock is stable.
+ */
+void host_shadow_restore(void)
+{
+	__raw_writel(sdhc_device.shadow.con, 0x481D812C);
+	__raw_writel(sdhc_device.shadow.hctl, 0x481D8228);
+	__raw_writel(sdhc_device.shadow.sysctl & ~0x00000004, 0x481D822C);
+
+	while (!(__raw_readl(0x481D822C) & 0x00000002))
+	{
+		;
+	}
+
+	__raw_writel(sdhc_device.shadow.sysctl, 0x481D822C);
+	__raw_writel(sdhc_device.shadow.ie, 0x481D8234);
+}
+
+/*!
+ * @brief Reset part of the controller and wait for it to finish
+ *
+ * @param mask         SD_SYSCTL reset bits: SRA, SRC or SRD
+ */
+void host_reset_line(unsigned int mask)
+{
+	__raw_writel(sdhc_device.shadow.sysctl | mask, 0x481D822C);
+
+	while (__raw_readl(0x481D822C) & mask)
+	{
+		;
+	}
+
+	/* A full reset clears every control register */
+	if (mask & 0x01000000)
+	{
+		host_shadow_load();
+	}
+}
+
+/*!
+ * @brief Set the enabled interrupt status bits
+ *
+ * @param mask         SD_IE value
+ */
+void host_set_irq(unsigned int mask)
+{
+	sdhc_shadow_write(&sdhc_device.shadow.ie, 0x481D8234, 0xFFFFFFFF, mask);
+}
 
 /*!
  * @brief uSDHC Controller Checks transfer
  *
- * @param instance     Instance number of the uSDHC module.
+ * @param stat         SD_STAT snapshot
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+static int sdhc_check_transfer(unsigned int stat)
+{
+	int status = FAIL;
+
+	if ((stat & 0x00000002) && !(stat & (0x00700000 | 0x02000000)))
+	{
+		status = SUCCESS;
+	}
+	else
+	{
+		printf("Error transfer status: 0x%x\n", stat);
+	}
+
+	return status;
+}
+
+
+#ifdef __ARM_NEON__
+/* Four back to back SD_DATA reads into r4-r7 */
+#define SDHC_FIFO_LDR4 \
+	"ldr r4, [%[fifo]]\n\t" \
+	"ldr r5, [%[fifo]]\n\t" \
+	"ldr r6, [%[fifo]]\n\t" \
+	"ldr r7, [%[fifo]]\n\t"
+
+/* One 64 byte line from SD_DATA into d0-d7 */
+#define SDHC_FIFO_LINE \
+	SDHC_FIFO_LDR4 "vmov d0, r4, r5\n\t" "vmov d1, r6, r7\n\t" \
+	SDHC_FIFO_LDR4 "vmov d2, r4, r5\n\t" "vmov d3, r6, r7\n\t" \
+	SDHC_FIFO_LDR4 "vmov d4, r4, r5\n\t" "vmov d5, r6, r7\n\t" \
+	SDHC_FIFO_LDR4 "vmov d6, r4, r5\n\t" "vmov d7, r6, r7\n\t"
+#endif
+
+/*!
+ * @brief Drain words from SD_DATA into memory a cache line at a time
+ *
+ * SD_DATA is read back to back into registers and each 64 byte line is
+ * stored in one go, with NEON when the build has it. Destinations that are
+ * not word aligned go through a line on the stack.
+ *
+ * @param dst          Destination
+ * @param words        Number of words to read
+ * 
+ * @return             Destination after the last word
+ */
+static int *sdhc_fifo_drain(int *dst, int words)
+{
+	uint32_t line[16];
+	int itr;
+
+#ifdef __ARM_NEON__
+	if (((unsigned long) dst & 0xF) == 0)
+	{
+		for (; words >= 16; words -= 16)
+		{
+			asm volatile(SDHC_FIFO_LINE
+				     "vst1.64 {d0-d3}, [%[dst]:128]!\n\t"
+				     "vst1.64 {d4-d7}, [%[dst]:128]!\n\t"
+				     : [dst] "+r" (dst)
+				     : [fifo] "r" (0x481D8220)
+				     : "r4", "r5", "r6", "r7", "d0", "d1", "d2", "d3",
+				       "d4", "d5", "d6", "d7", "memory");
+		}
+	}
+	else
+	{
+		for (; words >= 16; words -= 16)
+		{
+			asm volatile(SDHC_FIFO_LINE
+				     "vst1.8 {d0-d3}, [%[dst]]!\n\t"
+				     "vst1.8 {d4-d7}, [%[dst]]!\n\t"
+				     : [dst] "+r" (dst)
+				     : [fifo] "r" (0x481D8220)
+				     : "r4", "r5", "r6", "r7", "d0", "d1", "d2", "d3",
+				       "d4", "d5", "d6", "d7", "memory");
+		}
+	}
+#endif
+
+	if (((unsigned long) dst & 0x3) == 0)
+	{
+		for (; words >= 8; words -= 8)
+		{
+			line[0] = __raw_readl(0x481D8220);
+			line[1] = __raw_readl(0x481D8220);
+			line[2] = __raw_readl(0x481D8220);
+			line[3] = __raw_readl(0x481D8220);
+			line[4] = __raw_readl(0x481D8220);
+			line[5] = __raw_readl(0x481D8220);
+			line[6] = __raw_readl(0x481D8220);
+			line[7] = __raw_readl(0x481D8220);
+
+			dst[0] = line[0];
+			dst[1] = line[1];
+			dst[2] = line[2];
+			dst[3] = line[3];
+			dst[4] = line[4];
+			dst[5] = line[5];
+			dst[6] = line[6];
+			dst[7] = line[7];
+			dst += 8;
+		}
+
+		for (; words > 0; words--)
+		{
+			*dst = __raw_readl(0x481D8220);
+			dst++;
+		}
+	}
+	else
+	{
+		while (words > 0)
+		{
+			for (itr = 0; (itr < 16) && (itr < words); itr++)
+			{
+				line[itr] = __raw_readl(0x481D8220);
+			}
+
+			memcpy(dst, line, itr * 4);
+			dst += itr;
+			words -= itr;
+		}
+	}
+
+	return dst;
+}
+
+/*!
+ * @brief Move one watermark burst between the FIFO and the transfer buffer
+ *
+ * A short last read burst keeps the trailing bytes of the final word and
+ * drains the rest of the last block from the FIFO.
+ *
+ * @param xfer         Transfer in progress
+ */
+static void sdhc_xfer_burst(host_xfer_t *xfer)
+{
+	int itr, words, rem = 0;
+	unsigned int val = 0;
+	int *burst = xfer->buf;
+
+	words = xfer->length / 4;
+	if (words >= xfer->wml)
+	{
+		words = xfer->wml;
+	}
+	else
+	{
+		rem = xfer->length % 4;
+	}
+
+	if (xfer->dir == WRITE)
+	{
+		/* Write watermark words to FIFO */
+		for(itr = 0; itr < words; itr++)
+		{
+			__raw_writel(*xfer->buf, 0x481D8220);
+			xfer->buf++;
+		}
+
+		xfer->length -= words * 4;
+		return;
+	}
+
+	/* Read from FIFO watermark words */
+	xfer->buf = sdhc_fifo_drain(xfer->buf, words);
+
+	/* Trailing bytes of the last word */
+	if (rem != 0)
+	{
+		val = __raw_readl(0x481D8220);
+		memcpy(xfer->buf, &val, rem);
+	}
+
+	xfer->length -= (words * 4) + rem;
+
+	if (data_hook)
+	{
+		data_hook(data_hook_ctx, (uint8_t *) burst, (words * 4) + rem);
+	}
+
+	/* Clear FIFO, BRE drops once the rest of the last block is read */
+	for(itr = 0; (xfer->length == 0) && (itr < (BLK_LEN / 4)) &&
+		     (__raw_readl(0x481D8224) & 0x00000800); itr++)
+	{
+		val = __raw_readl(0x481D8220);
+	}
+}
+
+/*!
+ * @brief Split a DMA read into bounce head, aligned body and bounce tail
+ *
+ * The head runs up to the first cache line boundary of the buffer, the
+ * body covers the whole lines after it, and the tail takes the partial last
+ * line plus the rest of the last block.
+ *
+ * @param xfer         Transfer to split
+ * @param head         Bytes through the head bounce line
+ * @param body         Bytes straight into the caller buffer
+ * @param tail         Bytes through the tail bounce buffer
+ */
+static void sdhc_dma_split(host_xfer_t *xfer, uint32_t *head, uint32_t *body, uint32_t *tail)
+{
+	unsigned long addr = (unsigned long) xfer->buf;
+	uint32_t stream = DIV_ROUND_UP(xfer->length, BLK_LEN) * BLK_LEN;
+
+	*head = 0;
+	if ((addr % ARCH_DMA_MINALIGN) != 0)
+	{
+		*head = ARCH_DMA_MINALIGN - (addr % ARCH_DMA_MINALIGN);
+		if (*head > stream)
+		{
+			*head = stream;
+		}
+	}
+
+	*body = 0;
+	if (xfer->length > *head)
+	{
+		*body = ((xfer->length - *head) / ARCH_DMA_MINALIGN) * ARCH_DMA_MINALIGN;
+	}
+
+	*tail = stream - *head - *body;
+}
+
+/*!
+ * @brief Append ADMA2 descriptors for one memory range
+ *
+ * @param idx          Next free descriptor, negative after an overflow
+ * @param addr         Bus address of the range
+ * @param len          Length of the range in bytes
+ * 
+ * @return             Next free descriptor; -1 if the table is full
+ */
+static int sdhc_dma_add(int idx, unsigned long addr, uint32_t len)
+{
+	uint32_t chunk;
+
+	while ((idx >= 0) && (len > 0))
+	{
+		if (idx >= ADMA_DESC_COUNT)
+		{
+			return -1;
+		}
+
+		chunk = (len > ADMA_DESC_MAX_LEN) ? ADMA_DESC_MAX_LEN : len;
+
+		adma_desc[idx * 2] = (chunk << 16) | ADMA_ATTR_TRAN | ADMA_ATTR_VALID;
+		adma_desc[(idx * 2) + 1] = (uint32_t) addr;
+
+		addr += chunk;
+		len -= chunk;
+		idx++;
+	}
+
+	return idx;
+}
+
+/*!
+ * @brief Build the ADMA2 table for a transfer and do the cache maintenance
+ *
+ * The buffer cache maintenance is skipped if host_xfer_prepare() already
+ * did it. Reads send the partial lines at either end through bounce
+ * buffers, so neighbouring data is never lost.
+ *
+ * @param xfer         Transfer to map
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+static int sdhc_dma_map(host_xfer_t *xfer)
+{
+	unsigned long addr = (unsigned long) xfer->buf;
+	uint32_t head, body, tail;
+	int idx = 0;
+
+	if (!adma_desc)
+	{
+		return FAIL;
+	}
+
+	if (!xfer->prepared)
+	{
+		host_xfer_prepare(xfer);
+	}
+
+	if (xfer->dir == WRITE)
+	{
+		idx = sdhc_dma_add(idx, addr, xfer->length);
+	}
+	else
+	{
+		sdhc_dma_split(xfer, &head, &body, &tail);
+
+		if (head != 0)
+		{
+			invalidate_dcache_range((unsigned long) dma_head,
+						(unsigned long) dma_head + DMA_HEAD_LEN);
+			idx = sdhc_dma_add(idx, (unsigned long) dma_head, head);
+		}
+
+		if (body != 0)
+		{
+			idx = sdhc_dma_add(idx, addr + head, body);
+		}
+
+		if (tail != 0)
+		{
+			invalidate_dcache_range((unsigned long) dma_tail,
+						(unsigned long) dma_tail + DMA_TAIL_LEN);
+			idx = sdhc_dma_add(idx, (unsigned long) dma_tail, tail);
+		}
+	}
+
+	if (idx <= 0)
+	{
+		return FAIL;
+	}
+
+	adma_desc[(idx - 1) * 2] |= ADMA_ATTR_END;
+
+	flush_dcache_range((unsigned long) adma_desc,
+			   (unsigned long) adma_desc + ALIGN(idx * 8, ARCH_DMA_MINALIGN));
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Do the cache maintenance of a DMA transfer ahead of its command
+ *
+ * This is the expensive part of mapping a large buffer. Calling it while
+ * the previous transfer still moves data hides it behind that transfer.
+ * Writes clean the buffer rounded out to whole lines, reads invalidate the
+ * whole lines in the middle of the buffer. PIO transfers need nothing.
+ *
+ * @param xfer         Transfer set up but not started yet
+ */
+void host_xfer_prepare(host_xfer_t *xfer)
+{
+	unsigned long addr = (unsigned long) xfer->buf;
+	uint32_t head, body, tail;
+
+	if (xfer->dma)
+	{
+		if (xfer->dir == WRITE)
+		{
+			flush_dcache_range(addr & ~(ARCH_DMA_MINALIGN - 1),
+					   ALIGN(addr + xfer->length, ARCH_DMA_MINALIGN));
+		}
+		else
+		{
+			sdhc_dma_split(xfer, &head, &body, &tail);
+
+			if (body != 0)
+			{
+				invalidate_dcache_range(addr + head, addr + head + body);
+			}
+		}
+	}
+
+	xfer->prepared = TRUE;
+}
+
+/*!
+ * @brief Finish a DMA read: drop stale lines and copy the bounced ends out
+ *
+ * @param xfer         Finished transfer
+ */
+static void sdhc_dma_unmap(host_xfer_t *xfer)
+{
+	unsigned long addr = (unsigned long) xfer->buf;
+	uint8_t *dst = (uint8_t *) xfer->buf;
+	uint32_t head, body, tail;
+
+	if (xfer->dir == READ)
+	{
+		sdhc_dma_split(xfer, &head, &body, &tail);
+
+		if (body != 0)
+		{
+			invalidate_dcache_range(addr + head, addr + head + body);
+		}
+
+		if (head != 0)
+		{
+			invalidate_dcache_range((unsigned long) dma_head,
+						(unsigned long) dma_head + DMA_HEAD_LEN);
+			memcpy(dst, dma_head, (xfer->length < head) ? xfer->length : head);
+		}
+
+		if ((tail != 0) && (xfer->length > (head + body)))
+		{
+			invalidate_dcache_range((unsigned long) dma_tail,
+						(unsigned long) dma_tail + DMA_TAIL_LEN);
+			memcpy(dst + head + body, dma_tail, xfer->length - head - body);
+		}
+
+		if (data_hook)
+		{
+			data_hook(data_hook_ctx, dst, xfer->length);
+		}
+	}
+
+	xfer->length = 0;
+}
+
+/*!
+ * @brief Get the lines, status and DMA engine ready for a data command
+ *
+ * @param xfer         Transfer to be started
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+static int sdhc_xfer_begin(host_xfer_t *xfer)
+{
+	/* Wait for CMD/DATA lines to be free */
+	if (sdhc_wait_cmd_data_lines(DATA_PRESENT) == FAIL)
+	{
+		printf("Data/Command lines busy.\n");
+		return FAIL;
+	}
+
+	/* Clear interrupt status */
+	writel(0xFFFFFFFF, 0x481D8230);
+
+	/*Set appropriate bits in SD_IE register*/
+	host_set_irq(0x327f0033);
+
+	if (xfer->dma && (sdhc_dma_map(xfer) == FAIL))
+	{
+		printf("No ADMA table for this transfer, using PIO.\n");
+		xfer->dma = FALSE;
+	}
+
+	if (xfer->dma)
+	{
+		/* SD_HCTL DMAS = 32-bit ADMA2 */
+		sdhc_shadow_write(&sdhc_device.shadow.hctl, 0x481D8228, 0x00000018, 0x00000010);
+
+		/* SD_CON DMA_MNS = master */
+		sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0, 0x00100000);
+
+		__raw_writel(sdhc_device.adma_ptr, 0x481D8258);
+	}
+	else
+	{
+		sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0x00100000, 0);
+	}
+
+	xfer->state = XFER_CMD;
+	xfer->start = get_timer(0);
+	xfer->total = xfer->length;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Issue a data command and return without waiting for it
+ *
+ * The caller fills dir, buf, length, wml and dma of the transfer, then
+ * drives it with host_xfer_poll(). A DMA transfer the table cannot hold
+ * falls back to PIO.
+ *
+ * @param cmd          Data command to send
+ * @param xfer         Transfer to start
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int host_xfer_start(command_t *cmd, host_xfer_t *xfer)
+{
+	if (sdhc_xfer_begin(xfer) == FAIL)
+	{
+		return FAIL;
+	}
+
+	cmd->dma_enable = xfer->dma;
+
+	sdhc_cmd_cfg(cmd);
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Issue a data command from the pre-encoded table without waiting
+ *
+ * Same as host_xfer_start() without building and packing a command_t.
+ *
+ * @param id           Command to issue
+ * @param arg          Command argument
+ * @param xfer         Transfer to be started
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int host_xfer_start_fast(fast_cmd_t id, uint32_t arg, host_xfer_t *xfer)
+{
+	if (sdhc_xfer_begin(xfer) == FAIL)
+	{
+		return FAIL;
+	}
+
+	sdhc_cmd_issue(sdhc_fast_cmd[id] | (xfer->dma ? BM_SDHC_CMD_DE : 0), arg);
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Advance a transfer as far as SD_STAT allows without blocking
+ *
+ * @param xfer         Transfer in progress
+ * 
+ * @return             Transfer state after the step
+ */
+xfer_state_t host_xfer_poll(host_xfer_t *xfer)
+{
+	unsigned int stat = __raw_readl(0x481D8230);
+	unsigned int ready = (xfer->dir == WRITE) ? 0x00000400 : 0x00000800;
+
+	switch (xfer->state) {
+	case XFER_CMD:
+		/* Command complete or command error */
+		if (stat & 0x000F0001)
+		{
+			xfer->state = (sdhc_check_response(stat) == SUCCESS) ? XFER_DATA : XFER_ERROR;
+		}
+		else if (get_timer(xfer->start) > 1000)
+		{
+			printf("Command Timeout\n");
+			xfer->state = XFER_ERROR;
+		}
+		break;
+
+	case XFER_DATA:
+		/* Data timeout, CRC or end bit error */
+		if (stat & 0x00700000)
+		{
+			sdhc_check_transfer(stat);
+			xfer->state = XFER_ERROR;
+			break;
+		}
+
+		/* ADMA moves the data, wait for the end */
+		if (xfer->dma)
+		{
+			xfer->state = XFER_BUSY;
+			break;
+		}
+
+		/* Move every burst the buffer holds */
+		while ((xfer->length > 0) && (__raw_readl(0x481D8224) & ready))
+		{
+			sdhc_xfer_burst(xfer);
+		}
+
+		if (xfer->length == 0)
+		{
+			xfer->state = XFER_BUSY;
+		}
+		break;
+
+	case XFER_BUSY:
+		if (stat & 0x02000000)
+		{
+			printf("ADMA error: 0x%x\n", __raw_readl(0x481D8254));
+			xfer->state = XFER_ERROR;
+		}
+		/* Transfer complete, TC follows the card busy on writes */
+		else if (stat & 0x00700002)
+		{
+			xfer->state = (sdhc_check_transfer(stat) == SUCCESS) ? XFER_DONE : XFER_ERROR;
+
+			if ((xfer->state == XFER_DONE) && xfer->dma)
+			{
+				sdhc_dma_unmap(xfer);
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	/* After an error neither the FIFO nor the card block length is trusted */
+	if (xfer->state == XFER_ERROR)
+	{
+		sdhc_device.fifo_clean = FALSE;
+		sdhc_device.blk_len = 0;
+	}
+
+	return xfer->state;
+}
+
+/*!
+ * @brief Drive a transfer until it finishes
+ *
+ * @param xfer         Transfer in progress
  * 
  * @return             0 if successful; 1 otherwise
  */
-static int sdhc_check_transfer(void)
+int host_xfer_wait(host_xfer_t *xfer)
 {
-	int status = FAIL;
+	while ((xfer->state != XFER_DONE) && (xfer->state != XFER_ERROR))
+	{
+		host_xfer_poll(xfer);
+	}
+
+	return (xfer->state == XFER_DONE) ? SUCCESS : FAIL;
+}
 
-	if ((__raw_readl(0x481D8230) & 0x00000002) &&
-	     !(__raw_readl(0x481D8230) & 0x00080000) &&
-	     !(__raw_readl(0x481D8230) & 0x00100000))
+/*!
+ * @brief Clean up after a failed transfer and count the blocks that made it
+ *
+ * The count comes from the blocks SD_BLK still had to go and, for PIO
+ * reads, the whole blocks copied out of the FIFO. The last of them is
+ * dropped as well, the error may belong to it. A DMA read gets the
+ * bounced bytes of the intact blocks copied out, head and tail. The DAT
+ * and CMD lines are reset so the next command finds the controller idle.
+ *
+ * @param xfer         Transfer that ended in XFER_ERROR
+ * @param intact       Blocks at the start of the buffer known to be good
+ * 
+ * @return             0 if the transfer can be resumed; 1 otherwise
+ */
+int host_xfer_abort(host_xfer_t *xfer, uint32_t *intact)
+{
+	unsigned long addr = (unsigned long) xfer->buf;
+	uint8_t *dst = (uint8_t *) xfer->buf;
+	uint32_t head, body, tail, good;
+	uint32_t blocks = DIV_ROUND_UP(xfer->total, BLK_LEN);
+	uint32_t left = __raw_readl(0x481D8204) >> 16;
+	uint32_t done = (left < blocks) ? (blocks - left) : 0;
+
+	if ((xfer->dir == READ) && !xfer->dma)
 	{
-		status = SUCCESS;
+		done = min(done, (uint32_t) ((xfer->total - xfer->length) / BLK_LEN));
 	}
-	else
+
+	*intact = (done > 0) ? (done - 1) : 0;
+
+	if ((xfer->dir == READ) && xfer->dma && (*intact > 0))
 	{
-		printf("Error transfer status: 0x%x\n", __raw_readl(0x481D8230));
+		sdhc_dma_split(xfer, &head, &body, &tail);
+		good = min(*intact * BLK_LEN, (uint32_t) xfer->length);
+
+		if (body != 0)
+		{
+			invalidate_dcache_range(addr + head, addr + head + body);
+		}
+
+		if (head != 0)
+		{
+			invalidate_dcache_range((unsigned long) dma_head,
+						(unsigned long) dma_head + DMA_HEAD_LEN);
+			memcpy(dst, dma_head, min(head, good));
+		}
+
+		/* The tail line can hold the end of an intact block */
+		if ((tail != 0) && (good > (head + body)))
+		{
+			invalidate_dcache_range((unsigned long) dma_tail,
+						(unsigned long) dma_tail + DMA_TAIL_LEN);
+			memcpy(dst + head + body, dma_tail, good - head - body);
+		}
 	}
 
-	return status;
-}
+	host_reset_line(0x04000000);
+	host_reset_line(0x02000000);
+	writel(0xFFFFFFFF, 0x481D8230);
+
+	sdhc_device.fifo_clean = TRUE;
 
+	/* A read hook already saw part of the data, it cannot be replayed */
+	return ((xfer->dir == READ) && data_hook) ? FAIL : SUCCESS;
+}
 
 /*!
  * @brief uSDHC Controller reads data
@@ -67,63 +905,51 @@ static int sdhc_check_transfer(void)
  */
 int host_data_read(int *dst_ptr, int length, int wml)
 {
-	int idx, itr, loop;
-	unsigned int val = 0;
+	host_xfer_t xfer;
+	host_data_hook_t hook = data_hook;
+	int status;
 
 	/* Enable Interrupt */
-	val = __raw_readl(0x481D8234);
-	val |= 0x007F013F;
-	__raw_writel(val, 0x481D8234);
-
-	/* Read data to dst_ptr */
-	loop = length / (4 * wml);
-	for(idx = 0; idx < loop; idx++)
-	{
-		/* Wait until buffer ready */
-		while (!(__raw_readl(0x481D8224) & 0x00000800))
-		{
-			;
-		}
-		printf("Buffer ready.\n");
+	host_set_irq(sdhc_device.shadow.ie | 0x007F013F);
 
-		/* Read from FIFO watermark words */
-		for(itr = 0; itr < wml; itr++)
-		{
-			*dst_ptr = __raw_readl(0x481D8220);
-			dst_ptr++;
-		}
-	}
+	xfer.state = XFER_DATA;
+	xfer.dma = FALSE;
+	xfer.prepared = FALSE;
+	xfer.dir = READ;
+	xfer.buf = dst_ptr;
+	xfer.length = length;
+	xfer.wml = wml;
 
-	/* Read left data that not WML aligned */
-	loop = (length % (4 * wml)) / 4;
-	if (loop != 0)
-	{
-		/* Wait until buffer ready */
-		while (!(__raw_readl(0x481D8224) & 0x00000800))
-		{
-			;
-		}
-		printf("Buffer ready 2.\n");
+	/* Register reads such as EXT_CSD never reach the data hook */
+	data_hook = NULL;
+	status = host_xfer_wait(&xfer);
+	data_hook = hook;
 
-		/* Read the left to destination buffer */
-		for (itr = 0; itr < loop; itr++)
-		{
-			*dst_ptr = __raw_readl(0x481D8220);
-			dst_ptr++;
-		}
+	return status;
+}
 
-		/* Clear FIFO */
-		for(; itr < wml; itr++)
-		{
-			idx = __raw_readl(0x481D8220);
-		}
-	}
+/*!
+ * @brief uSDHC Controller writes data
+ * 
+ * @param src_ptr      Pointer for data source
+ * @param length       Data length to be written, multiple of 4 * wml
+ * @param wml          Watermark for data writing
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int host_data_write(int *src_ptr, int length, int wml)
+{
+	host_xfer_t xfer;
 
-	/* Wait until transfer complete */
-	while (!(__raw_readl(0x481D8230) & 0x00700002));
+	xfer.state = XFER_DATA;
+	xfer.dma = FALSE;
+	xfer.prepared = FALSE;
+	xfer.dir = WRITE;
+	xfer.buf = src_ptr;
+	xfer.length = length;
+	xfer.wml = wml;
 
-	/* Check if error happened */
-	return sdhc_check_transfer();
+	return host_xfer_wait(&xfer);
 }
 
 /*!
@@ -157,36 +983,168 @@ void host_cfg_block(int blk_len, int nob)
 	__raw_writel(sd_blk, 0x481D8204);
 }
 
+/*!
+ * @brief Current card clock
+ *
+ * @return             Card clock in kHz
+ */
+unsigned int host_clock_khz(void)
+{
+	unsigned int clkd = (sdhc_device.shadow.sysctl >> 6) & 0x3FF;
+
+	return SDHC_REF_CLK_KHZ / (clkd ? clkd : 1);
+}
+
+/*!
+ * @brief Key of the current bus mode, card clock and data width
+ *
+ * @return             Clock in kHz times 16 plus the bus width
+ */
+static unsigned int sdhc_bus_mode(void)
+{
+	unsigned int width = 1;
+
+	if (sdhc_device.shadow.con & 0x00000020)
+	{
+		width = 8;
+	}
+	else if (sdhc_device.shadow.hctl & 0x00000002)
+	{
+		width = 4;
+	}
+
+	return (host_clock_khz() * 16) + width;
+}
+
+/*!
+ * @brief Pick the FIFO burst for a transfer in the current bus mode
+ *
+ * ADMA moves whole blocks on its own. PIO uses the burst calibrated for
+ * this clock and width, or a whole block if the mode was never timed.
+ *
+ * @param dma          Transfer moves the data with ADMA2
+ *
+ * @return             Burst size in words
+ */
+int host_wml_select(int dma)
+{
+	if (!dma && (sdhc_device.wml != 0) && (sdhc_device.wml_mode == sdhc_bus_mode()))
+	{
+		return sdhc_device.wml;
+	}
+
+	return ESDHC_BLKATTR_WML_BLOCK;
+}
+
+/*!
+ * @brief Store the PIO burst for the current bus mode
+ *
+ * @param wml          Burst size in words, divides the block; 0 for the default
+ */
+void host_wml_set(int wml)
+{
+	sdhc_device.wml = wml;
+	sdhc_device.wml_mode = sdhc_bus_mode();
+}
+
+/*!
+ * @brief Program the data timeout counter for the current card clock
+ *
+ * The smallest DTO that covers the timeout is used, so a card that stops
+ * answering is caught early instead of after 2^27 clocks.
+ *
+ * @param timeout_us   Timeout in microseconds
+ * @param timeout_clks Timeout part given in card clocks
+ * 
+ * @return             DTO value programmed
+ */
+int host_set_data_timeout(uint32_t timeout_us, uint32_t timeout_clks)
+{
+	/* Both sides scaled by 1000 to stay in clocks without a division */
+	uint64_t need = ((uint64_t) timeout_us * host_clock_khz()) + ((uint64_t) timeout_clks * 1000);
+	int dto = 0;
+
+	while ((dto < SDHC_DTO_MAX) && ((((uint64_t) 1 << (13 + dto)) * 1000) < need))
+	{
+		dto++;
+	}
+
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x000F0000, dto << 16);
+
+	return dto;
+}
+
+/*!
+ * @brief Wait for the card to release DAT0 after an R1b command
+ *
+ * TC marks the end of busy. If the data timeout counter expires first
+ * the DAT0 level is polled until the card lets go of the line. Both are
+ * polled without a delay, a switch often ends within microseconds.
+ *
+ * @param timeout_ms   Busy timeout in milliseconds
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int host_wait_busy(int timeout_ms)
+{
+	unsigned int start = get_timer(0);
+
+	while (!(__raw_readl(0x481D8230) & 0x00100002))
+	{
+		if (get_timer(start) >= timeout_ms)
+		{
+			printf("Busy timeout\n");
+			return FAIL;
+		}
+	}
+
+	if (!(__raw_readl(0x481D8230) & 0x00100000))
+	{
+		return SUCCESS;
+	}
+
+	/* DTO expired before busy end, watch DAT0 directly */
+	while (!(__raw_readl(0x481D8224) & 0x00100000))
+	{
+		if (get_timer(start) >= timeout_ms)
+		{
+			printf("Busy timeout\n");
+			return FAIL;
+		}
+	}
+
+	return SUCCESS;
+}
+
 /*!
  * @brief uSDHC Controller Checks response
  *
- * @param instance     Instance number of the uSDHC module.
+ * @param stat         SD_STAT snapshot
  * 
  * @return             0 if successful; 1 otherwise
  */
-static int sdhc_check_response(void)
+static int sdhc_check_response(unsigned int stat)
 {
 	int status = FAIL;
 	int val;
 
-	if ((readl(0x481D8230) & 0x0000001) &&
-	    (!(readl(0x481D8230) & 0x0000100)) &&
-	    (!(readl(0x481D8230) & 0x0000200)) &&
-	    (!(readl(0x481D8230) & 0x0000400)) &&
-	    (!(readl(0x481D8230) & 0x0000800)))
+	if ((stat & 0x0000001) && !(stat & 0x000F0000))
 	   {
 	   	status = SUCCESS; 
 	   }
 	else
 	{
-		printf("Error status: 0x%x\n", __raw_readl(0x481D8230));
-		/* Clear CIHB and CDIHB status */
-		if ((__raw_readl(0x481D8224) & 0x00000001) ||
-		   (__raw_readl(0x481D8224) & 0x00000002))
-		   {
-			val = (__raw_readl(0x481D822C) | 0x01000000);
-		   	writel(val, 0x481D822F);
-		   }
+		printf("Error status: 0x%x\n", stat);
+		/* Clear CIHB and CDIHB status with a CMD and DAT line reset */
+		val = __raw_readl(0x481D8224);
+		if (val & 0x00000001)
+		{
+			host_reset_line(0x02000000);
+		}
+		if (val & 0x00000002)
+		{
+			host_reset_line(0x04000000);
+		}
 	}
 	    	
 	return status;
@@ -195,15 +1153,15 @@ static int sdhc_check_response(void)
 /*!
  * @brief Wait for command complete and without error
  *
- * @param instance     Instance number of the uSDHC module.
- * 
+ * @return             Last SD_STAT read
  */
-static void sdhc_wait_end_cmd_resp_intr(void)
+static unsigned int sdhc_wait_end_cmd_resp_intr(void)
 {
 	int count = ZERO;
 	unsigned int val = 0x00000000;
+	unsigned int stat;
 
-	while (!(__raw_readl(0x481D8230) & 0x020F0001))
+	while (!((stat = __raw_readl(0x481D8230)) & 0x020F0001))
 	//while (!(__raw_readl(0x481D8230) & 0x00010000))
 	{
 		if (count == 1000)
@@ -212,13 +1170,15 @@ static void sdhc_wait_end_cmd_resp_intr(void)
 			
 			val = __raw_readl(0x481D8224);
 			printf("The SD_PSTATE: %x\n", val);
-			return;
+			return stat;
 		}
 
 		count++;
 		udelay(1000);
 	}
 	//printf("Command Failed\n");
+
+	return stat;
 }
 
 
@@ -244,7 +1204,7 @@ static void sdhc_cmd_cfg(command_t *cmd)
 //	val = __raw_readl(0x481D8228) & ~0x00000018;
 //	__raw_writel(val, 0x481D8228);
 
-	cmd0 = __raw_readl(0x481D820C) & ~0x3FFB0037;
+	cmd0 = sdhc_device.shadow.cmd & ~0x3FFB0037;
 	cmd0 = (cmd0 | ( ((cmd->dma_enable) << BP_SDHC_CMD_DE) |
 		 ((cmd->block_count_enable_check) << BP_SDHC_CMD_BCE) |
 	 	 ((cmd->acmd12_enable) << BP_SDHC_CMD_ACEN) |
@@ -266,6 +1226,7 @@ static void sdhc_cmd_cfg(command_t *cmd)
 	printf("cmd2 = %x\n", cmd2);
 
 	//cmd3 = cmd2 | cmd0;
+	sdhc_device.shadow.cmd = cmd2;
 	__raw_writel(cmd2, 0x481D820C);
 
 	//printf("cmd3 = %x\n", cmd3);
@@ -274,6 +1235,20 @@ static void sdhc_cmd_cfg(command_t *cmd)
 	//__raw_writeb(cmd3, 0x481D820F);
 }
 
+/*!
+ * @brief Write a ready-made command word and its argument
+ *
+ * @param word         SD_CMD value
+ * @param arg          Command argument
+ */
+static void sdhc_cmd_issue(uint32_t word, uint32_t arg)
+{
+	__raw_writel(arg, 0x481D8208);
+
+	sdhc_device.shadow.cmd = word;
+	__raw_writel(word, 0x481D820C);
+}
+
 /*!
  * @brief Wait for command inhibit(CMD) and command inhibit(DAT) idle for 
  * issuing next SD/MMC command. 
@@ -327,6 +1302,7 @@ static int sdhc_wait_cmd_data_lines(int data_present)
 int host_send_cmd(command_t * cmd)
 {
 	unsigned int val = 0;
+	unsigned int stat;
 
 	/* Clear Interrupt status register */
 //	val = __raw_readl(0x481D8230) & ~0x037F01FF;
@@ -357,33 +1333,70 @@ int host_send_cmd(command_t * cmd)
 
 	
 	/*Set appropriate bits in SD_IE register*/
-	__raw_writel(0x327f0033, 0x481D8234);
+	host_set_irq(0x327f0033);
 	
 	sdhc_cmd_cfg(cmd);
 
-	sdhc_wait_end_cmd_resp_intr();
+	stat = sdhc_wait_end_cmd_resp_intr();
 
 	/* Mask all interrupts */
 //	__raw_writel(0x00000000, 0x481D8238);
 
 	/* Check if an error occured */
-	return sdhc_check_response();
+	return sdhc_check_response(stat);
 }
 
-void host_init_active(void)
+/*!
+ * @brief Send a command from the pre-encoded table and check the response
+ *
+ * For fixed commands on the I/O path. Commands that need anything the
+ * table does not hold go through card_cmd_config() and host_send_cmd().
+ *
+ * @param id           Command to send
+ * @param arg          Command argument
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int host_send_fast_cmd(fast_cmd_t id, uint32_t arg)
 {
-	unsigned int val = 0;
+	uint32_t word = sdhc_fast_cmd[id];
+
+	if (sdhc_wait_cmd_data_lines((word & BM_SDHC_CMD_DP) ? DATA_PRESENT : DATA_PRESENT_NONE) == FAIL)
+	{
+		printf("Data/Command lines busy.\n");
+		return FAIL;
+	}
+
+	writel(0xFFFFFFFF, 0x481D8230);
+
+	host_set_irq(0x327f0033);
+
+	sdhc_cmd_issue(word, arg);
 
+	return sdhc_check_response(sdhc_wait_end_cmd_resp_intr());
+}
+
+/*!
+ * @brief Start the init clocks, the card powers up while they run
+ *
+ * host_init_end() stops them again, at least 10 ms later.
+ */
+void host_init_begin(void)
+{
 	/* Send 80 clock ticks for card to power up */
-	val = __raw_readl(0x481D812C) & ~0x00000002;
-	val |= 0x00000002;
-	__raw_writel(val, 0x481D812C);
+	sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0x00000002, 0x00000002);
 
 	/*Write 0x00000000 to SD_CMD register*/
+	sdhc_device.shadow.cmd = 0x00000000;
 	__raw_writel(0x00000000, 0x481D820C);
+}
 
-	/*Wait for 10ms*/
-	udelay(10000);
+/*!
+ * @brief Stop the init clocks started by host_init_begin()
+ */
+void host_init_end(void)
+{
+	unsigned int val = 0;
 
 	/* Set CC bit to 1 in SD_STAT[0] register */
 	val = __raw_readl(0x481D8230) & ~0x00000001;
@@ -391,8 +1404,7 @@ void host_init_active(void)
 	__raw_writel(val, 0x481D8230);
 
 	/* End initialization sequence */
-	val = __raw_readl(0x481D812C) & ~0x00000002;
-	__raw_writel(val, 0x481D812C);
+	sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0x00000002, 0);
 
 	/* Clear SD_STATregister */
 	__raw_writel(0xFFFFFFFF, 0x481D8230);
@@ -404,18 +1416,25 @@ void host_init_active(void)
 	}*/
 }
 
+void host_init_active(void)
+{
+	host_init_begin();
+
+	/*Wait for 10ms*/
+	udelay(10000);
+
+	host_init_end();
+}
+
 void host_cfg_clock(int frequency)
 {
 	unsigned int cap = 0;
-	unsigned int val = 0;
 
 	cap = __raw_readl(0x481D8240);
 	printf ("The capability register is %u\n", cap);
 
 	/*Enable internal clock*/
-	val = __raw_readl(0x481D822C) & ~0x00000001;
-	val |= 0x00000001;
-	__raw_writel(val, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x00000001, 0x00000001);
 
 	/*Wait until clock stable*/	
 	while(!(__raw_readl(0x481D822C) & 0x00000002))
@@ -425,8 +1444,7 @@ void host_cfg_clock(int frequency)
 	printf("Internal clock stable_1\n");
 
 	/*Clear DTO, CLKD and CEN*/
-	val = __raw_readl(0x481D822C) & ~0x000FFFC4;
-	__raw_writel(val, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x000FFFC4, 0);
 	
 	/*Wait until clock stable*/
 	while(!(__raw_readl(0x481D822C) & 0x00000002))
@@ -443,27 +1461,19 @@ void host_cfg_clock(int frequency)
 	/*Set frequency dividers*/
 	if (frequency == IDENTIFICATION_FREQ)
 	{
-		val = __raw_readl(0x481D822C) & ~0x0000FFC0;
-		val |=0x000003C0;
-		__raw_writel(val, 0x481D822C);		
+		sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x0000FFC0, 0x000003C0);		
 	}
 	else if (frequency == OPERATING_FREQ)
 	{
-		val = __raw_readl(0x481D822C) & ~0x0000FFC0;
-		val |= 0x00000000;
-		__raw_writel(val, 0x481D822C);			
+		sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x0000FFC0, 0x00000000);			
 	}
 	else if (frequency == HS_FREQ)
 	{
-		val = __raw_readl(0x481D822C) & ~0x0000FFC0;
-		val |= 0x00000000;
-		__raw_writel(val, 0x481D822C);		
+		sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x0000FFC0, 0x00000000);		
 	}
 	else if (frequency == INIT_FREQ)
 	{
-		val = __raw_readl(0x481D822C) & ~0x0000FFC0;
-		val |= 0x000FFC00;
-		__raw_writel(val, 0x481D822C);		
+		sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x0000FFC0, 0x000FFC00);		
 	}
 
 	/*Wait until clock stable*/
@@ -474,19 +1484,14 @@ void host_cfg_clock(int frequency)
 	printf("Internal clock stable after setting frequency\n");
 	
 	/*Set Data timeout frequency*/
-	val = __raw_readl(0x481D822C) & 0x000F0000;
-	val |= 0x0000000E;
-	__raw_writel(val, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, ~0x000F0000, 0x0000000E & ~SDHC_SYSCTL_VOLATILE);
 
-	val = __raw_readl(0x481D822C) & ~0x00000004;
-	val |= 0x00000004;
-	__raw_writel(val, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x00000004, 0x00000004);
 }
 
 /* SD/MMC bus configuration */
 static void host_configure_bus(int dat_width)
 {
-	unsigned int val = 0;
 	unsigned int cap = 0;
 	
 	cap = __raw_readl(0x481D8240);
@@ -503,8 +1508,7 @@ static void host_configure_bus(int dat_width)
 	
 	//val = __raw_readl(0x481D8228) & ~0x00000A02;
 	/*Set SDVS to 5h*/
-	val = 0x00000A00;
-	__raw_writel(val, 0x481D8228);
+	sdhc_shadow_write(&sdhc_device.shadow.hctl, 0x481D8228, 0xFFFFFFFF, 0x00000A00);
 	
 	cap = __raw_readl(0x481D8228);
 	printf ("The hctl register is %x\n", cap);
@@ -529,19 +1533,19 @@ static void host_configure_bus(int dat_width)
 	 * INIT = 0x0
 	 * OD   = 0x0
 	 */
-	__raw_writel(0x00000600, 0x481D812C);
+	sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0xFFFFFFFF, 0x00000600);
 
 	/*Set SD_SYSCTL register*/
 	/* DTO  = 0xE 
 	 */
-	__raw_writel(0x000e0000, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0xFFFFFFFF, 0x000e0000);
 	
 	/*Set SD_SYSCTL register*/
 	/* DTO  = 0xE
 	 * CLKD = 0x3C
 	 * ICE  = 0x1
 	 */
-	__raw_writel(0x000e3c01, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0xFFFFFFFF, 0x000e3c01);
 
 	while(! (__raw_readl(0x481D822C) & 0x00000002));
 	{
@@ -554,16 +1558,16 @@ static void host_configure_bus(int dat_width)
 	 * CLKD = 0x3C
 	 * ICE  = 0x5
 	 */
-	__raw_writel(0x000e3c05, 0x481D822C);
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0xFFFFFFFF, 0x000e3c05);
 	
 	/*Set SD_HCTL register*/
 	/* SDVS  = 0x5
 	 * SDBP  = 0x1
 	 */
-	__raw_writel(0x00000b00, 0x481D8228);
+	sdhc_shadow_write(&sdhc_device.shadow.hctl, 0x481D8228, 0xFFFFFFFF, 0x00000b00);
 	
 	/*Set appropriate bits in SD_IE register*/
-	__raw_writel(0x327f0033, 0x481D8234);
+	host_set_irq(0x327f0033);
 	
 	/*if(dat_width == 1)
 	{	
@@ -633,26 +1637,20 @@ static void host_configure_bus(int dat_width)
 
 static void sdhc_set_data_transfer_width(int dat_width)
 {
-	unsigned int val = 0;
 
 	switch (dat_width) {
 	case 8:
-		val = readl(0x481D812C) | 0x00000020;
-		writel(val, 0x481D812C);
+		sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0, 0x00000020);
 		break;
 
 	case 4:
-		val = readl(0x481D812C) & ~0x00000020;
-		writel(val, 0x481D812C);
-		val = readl(0x481D8228) | 0x00000002;
-		writel(val, 0x481D8228);
+		sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0x00000020, 0);
+		sdhc_shadow_write(&sdhc_device.shadow.hctl, 0x481D8228, 0, 0x00000002);
 		break;
 	
 	case 1:
-		val = readl(0x481D812C) & ~0x00000020;
-		writel(val, 0x481D812C);
-		val = readl(0x481D8228) & ~0x00000002;
-		writel(val, 0x481D8228);
+		sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0x00000020, 0);
+		sdhc_shadow_write(&sdhc_device.shadow.hctl, 0x481D8228, 0x00000002, 0);
 		break;
 	}	
 }
@@ -664,6 +1662,46 @@ void host_set_bus_width(int bus_width)
 	sdhc_set_data_transfer_width(bus_width);
 }
 
+/*!
+ * @brief Check whether the card holds DAT0 low
+ *
+ * @return             TRUE while the card signals busy
+ */
+int host_card_busy(void)
+{
+	return (__raw_readl(0x481D8224) & 0x00100000) ? FALSE : TRUE;
+}
+
+/*!
+ * @brief Change the card clock and bus timing
+ *
+ * The card clock is stopped while CLKD, HSPE and DDR change and started
+ * again once the internal clock is stable.
+ *
+ * @param clkd         SD_SYSCTL clock divider
+ * @param hs           Drive the bus on the rising edge (SD_HCTL HSPE)
+ * @param ddr          Dual data rate (SD_CON DDR)
+ */
+void host_set_bus_speed(unsigned int clkd, int hs, int ddr)
+{
+	/* CEN off */
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x00000004, 0);
+
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0x0000FFC0, (clkd & 0x3FF) << 6);
+
+	sdhc_shadow_write(&sdhc_device.shadow.hctl, 0x481D8228, 0x00000004, hs ? 0x00000004 : 0);
+	sdhc_shadow_write(&sdhc_device.shadow.con, 0x481D812C, 0x00080000, ddr ? 0x00080000 : 0);
+
+	/* Wait until clock stable */
+	while (!(__raw_readl(0x481D822C) & 0x00000002))
+	{
+		;
+	}
+
+	/* CEN on */
+	sdhc_shadow_write(&sdhc_device.shadow.sysctl, 0x481D822C, 0, 0x00000004);
+}
+
 void host_reset(int bus_width)
 {
 	unsigned int val = 0;
@@ -678,13 +1716,8 @@ void host_reset(int bus_width)
 	}
 	
 	/*sysctl resetall*/
-	val = __raw_readl(0x481D822C) | 0x01000000;
-	__raw_writel(val, 0x481D822C);
-
-	while (__raw_readl(0x481D822C) & 0x01000000)
-	{
-		;
-	}
+	host_shadow_load();
+	host_reset_line(0x01000000);
 
 	printf("Software reset done\n");
 
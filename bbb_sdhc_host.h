@@ -3,13 +3,109 @@
 
 #define ESDHC_BLKATTR_WML_BLOCK       (0x80)
 
+/* Smallest PIO burst in words, bursts must divide the block */
+#define SDHC_WML_MIN 16
+
+/* SD_SYSCTL bits kept out of the shadow: ICS status and the self clearing resets */
+#define SDHC_SYSCTL_VOLATILE 0x07000002
+
+/* MMCHS functional clock, divided by SD_SYSCTL CLKD for the card clock */
+#define SDHC_REF_CLK_KHZ 96000
+
+/* Largest SD_SYSCTL DTO value, 2^27 card clocks */
+#define SDHC_DTO_MAX 14
+
+/* ADMA2 descriptor attributes */
+#define ADMA_ATTR_VALID	0x0001
+#define ADMA_ATTR_END	0x0002
+#define ADMA_ATTR_TRAN	0x0020
+
+/* Bytes per descriptor, and descriptors for the largest transfer plus bounce ends */
+#define ADMA_DESC_MAX_LEN 0xFE00
+#define ADMA_DESC_COUNT   (((0xFFFF * BLK_LEN) / ADMA_DESC_MAX_LEN) + 3)
+
+/* Bounce buffers for the partial cache lines at the ends of a DMA read */
+#define DMA_HEAD_LEN	ARCH_DMA_MINALIGN
+#define DMA_TAIL_LEN	(ARCH_DMA_MINALIGN + BLK_LEN)
+
+/* SD_CMD word of a command with CRC and index checks, known at compile time */
+#define SDHC_CMD_WORD(idx, rsp, dp, dir, multi) \
+	(((idx) << BP_SDHC_CMD_INDX) | ((dp) << BP_SDHC_CMD_DP) | \
+	 BM_SDHC_CMD_CICE | BM_SDHC_CMD_CCCE | ((rsp) << BP_SDHC_CMD_RSP_TYP) | \
+	 ((dir) << BP_SDHC_CMD_DDIR) | \
+	 ((multi) ? (BM_SDHC_CMD_MSBS | BM_SDHC_CMD_ACEN | BM_SDHC_CMD_BCE) : 0))
+
+/* Called with each burst of read data while it is still in cache */
+typedef void (*host_data_hook_t)(void *ctx, const uint8_t *buf, int len);
+
+/* Commands issued through the pre-encoded table */
+typedef enum {
+    FAST_CMD6,                  //SWITCH, R1b
+    FAST_CMD7,                  //SELECT_CARD, R1b
+    FAST_CMD8,                  //SEND_EXT_CSD, one block read
+    FAST_CMD12,                 //STOP_TRANSMISSION as abort, R1b, used for HPI
+    FAST_CMD13,                 //SEND_STATUS
+    FAST_CMD16,                 //SET_BLOCKLEN
+    FAST_CMD18,                 //READ_MULTIPLE_BLOCK
+    FAST_CMD25,                 //WRITE_MULTIPLE_BLOCK
+    FAST_CMD32,                 //ERASE_WR_BLK_START, SD
+    FAST_CMD33,                 //ERASE_WR_BLK_END, SD
+    FAST_CMD35,                 //ERASE_GROUP_START
+    FAST_CMD36,                 //ERASE_GROUP_END
+    FAST_CMD38,                 //ERASE, R1b
+    FAST_CMD_COUNT
+} fast_cmd_t;
+
+typedef enum {
+    XFER_CMD,
+    XFER_DATA,
+    XFER_BUSY,
+    XFER_DONE,
+    XFER_ERROR
+} xfer_state_t;
+
+typedef struct {
+    xfer_state_t state;
+    xfer_type_t dir;            //READ or WRITE
+    int *buf;                   //next word to move
+    int length;                 //bytes left
+    int total;                  //bytes in the transfer
+    int wml;                    //watermark in words
+    unsigned char dma;          //move the data with ADMA2
+    unsigned char prepared;     //buffer cache maintenance already done
+    unsigned int start;         //command issue time in ms
+} host_xfer_t;
+
 int host_data_read(int *dst_ptr, int length, int wml);
+int host_data_write(int *src_ptr, int length, int wml);
 void host_read_response(command_response_t *response);
 int host_send_cmd(command_t * cmd);
+void host_init_begin(void);
+void host_init_end(void);
 void host_init_active(void);
 void host_cfg_clock(int frequency);
 void host_set_bus_width(int bus_width);
+void host_set_bus_speed(unsigned int clkd, int hs, int ddr);
 void host_reset(int bus_width);
 void host_cfg_block(int blk_len, int nob);
+int host_wait_busy(int timeout_ms);
+int host_card_busy(void);
+unsigned int host_clock_khz(void);
+int host_set_data_timeout(uint32_t timeout_us, uint32_t timeout_clks);
+void host_set_data_hook(host_data_hook_t hook, void *ctx);
+int host_dma_init(void);
+void host_shadow_load(void);
+void host_shadow_restore(void);
+void host_reset_line(unsigned int mask);
+void host_set_irq(unsigned int mask);
+void host_xfer_prepare(host_xfer_t *xfer);
+int host_wml_select(int dma);
+void host_wml_set(int wml);
+int host_xfer_start(command_t *cmd, host_xfer_t *xfer);
+int host_send_fast_cmd(fast_cmd_t id, uint32_t arg);
+int host_xfer_start_fast(fast_cmd_t id, uint32_t arg, host_xfer_t *xfer);
+xfer_state_t host_xfer_poll(host_xfer_t *xfer);
+int host_xfer_wait(host_xfer_t *xfer);
+int host_xfer_abort(host_xfer_t *xfer, uint32_t *intact);
 
 #endif
@@ -15,17 +15,55 @@
 #include <u-boot/sha256.h>
 
 static struct csd_struct csd_reg;
-static uint32_t ext_csd_data[BLK_LEN / FOUR];
+
+/* CSD TAAC time units in ns and multipliers times 10 */
+static const unsigned int taac_unit_ns[8] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000
+};
+static const unsigned char taac_mult[16] = {
+	0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+};
+static uint32_t *ext_csd_data;
 static uint32_t mmc_version = MMC_CARD_INV;
 
+/* Bus speed ladder, indexed by bus_level_t */
+static const bus_level_cfg_t mmc_bus_levels[BUS_LEVEL_COUNT] = {
+	[BUS_LEGACY_1BIT] = { "legacy 1-bit", ESD_BUS_WIDTH_1, 0, 1, FALSE, MMC_LEGACY_CLKD },
+	[BUS_HS_4BIT]     = { "HS52 4-bit", ESD_BUS_WIDTH_4, 1, 4, FALSE, MMC_HS_CLKD },
+	[BUS_HS52_8BIT]   = { "HS52 8-bit", ESD_BUS_WIDTH_8, 1, 8, FALSE, MMC_HS_CLKD },
+	[BUS_DDR52_8BIT]  = { "DDR52 8-bit", ESD_BUS_WIDTH_8_DDR, 1, 8, TRUE, MMC_HS_CLKD },
+};
+
 static int mmc_read_esd(void);
+static void mmc_switch_rejected(uint32_t arg);
+static int mmc_switch_timeout(uint32_t arg, int timeout_ms);
+static int mmc_switch_check(void);
 static int mmc_switch(uint32_t arg);
 static int mmc_set_bus_width(int bus_width);
 static int mmc_read_csd(void);
 static uint32_t mmc_get_spec_ver(void);
 static int mmc_set_rca(void);
+static uint32_t mmc_csd_bits(int start, int size);
+static void mmc_cfg_erase(void);
+static void mmc_cfg_cache(void);
+static void mmc_cfg_optimal(void);
+int mmc_cache_ctrl(int enable);
+int mmc_cache_flush(void);
+int mmc_set_bus_level(bus_level_t level);
+const char *mmc_bus_level_name(bus_level_t level);
+static void mmc_bus_negotiate(void);
+static void mmc_cfg_sleep(void);
+static void mmc_cfg_bkops(void);
+static int mmc_bkops_level(void);
+int mmc_bkops_enable(void);
+int mmc_bkops_idle(int budget_ms);
+int mmc_bkops_finish(void);
+static void mmc_cfg_hpi(void);
+int mmc_hpi_preempt(void);
+int mmc_sleep_awake(int sleep);
 int emmc_init(void);
 int mmc_voltage_validation(void);
+int mmc_ocr_poll(void);
 void emmc_print_cfg_info(void);
 
 /*!
@@ -37,29 +75,27 @@ void emmc_print_cfg_info(void);
  */
 static int mmc_read_esd(void)
 {
-	command_t cmd;
 	unsigned int i = 0;
 	int status = FAIL;
 
-	/* Set block length */
-	card_cmd_config(&cmd, CMD16, BLK_LEN, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
-
-	printf("Send CMD16.\n");
+	if (!ext_csd_data)
+	{
+		return FAIL;
+	}
 
-	/* Send CMD16 */
-	if (SUCCESS == host_send_cmd(&cmd))
+	/* Set block length */
+	if (SUCCESS == card_set_blklen(BLK_LEN))
 	{
 		/* Configure block attribute */
 		host_cfg_block(BLK_LEN, ONE);
 		printf("Host block configured\n");
 		
-		/* Read extended CSD */
-		card_cmd_config(&cmd, CMD8, NO_ARG, READ, RESPONSE_48, DATA_PRESENT, TRUE, TRUE);
-
 		printf("Send CMD8.\n");
 
-		/* Send CMD8 */
-		if (SUCCESS == host_send_cmd(&cmd))
+		card_set_dto(DTO_READ, 0);
+
+		/* Read extended CSD */
+		if (SUCCESS == host_send_fast_cmd(FAST_CMD8, NO_ARG))
 		{
 			status = host_data_read((int*) ext_csd_data, BLK_LEN, SDHC_BLKATTR_WML_BLOCK);
 			for (i = 0; i < (BLK_LEN / FOUR); i++)
@@ -72,33 +108,134 @@ static int mmc_read_esd(void)
 	return status;
 }
 
+/*!
+ * @brief Undo what was recorded for a switch the card rejected
+ *
+ * Bus width and timing are left to the data check of the bus level.
+ *
+ * @param arg          Argument of the rejected CMD6
+ */
+static void mmc_switch_rejected(uint32_t arg)
+{
+	printf("Card rejected switch 0x%x.\n", arg);
+
+	switch ((arg >> 16) & 0xFF)
+	{
+	case MMC_ESD_OFF_ERASE_GRP_DEF:
+		sdhc_device.erase_grp_size = (mmc_csd_bits(42, 5) + 1) * (mmc_csd_bits(37, 5) + 1);
+		sdhc_device.erase_timeout = MMC_ERASE_TMO_UNIT;
+		break;
+
+	case MMC_ESD_OFF_CACHE_CTRL:
+		sdhc_device.cache_on = ((arg >> MMC_SWITCH_SET_PARAM_SHIFT) & 0xFF) ? FALSE : TRUE;
+		break;
+
+	case MMC_ESD_OFF_BKOPS_EN:
+		sdhc_device.bkops_en = FALSE;
+		break;
+
+	case MMC_ESD_OFF_HPI_MGMT:
+		sdhc_device.hpi_en = FALSE;
+		break;
+
+	default:
+		break;
+	}
+}
+
 /*!
  * @brief Check switch ability and switch function 
  * 
- * @param instance     Instance number of the uSDHC module.
+ * A rejected switch only shows as SWITCH_ERROR in the R1 of the next
+ * command. The R1 of each CMD6 is checked for the switch before it; the
+ * last switch of a batch is left for mmc_switch_check().
+ * 
  * @param arg          Argument to command 6 
+ * @param timeout_ms   Busy timeout of the switch
  * 
  * @return             0 if successful; 1 otherwise
  */
-static int mmc_switch(uint32_t arg)
+static int mmc_switch_timeout(uint32_t arg, int timeout_ms)
 {
-	command_t cmd;
+	command_response_t response;
 	int status = FAIL;
 
-	/* Configure MMC Switch Command */
-	card_cmd_config(&cmd, CMD6, arg, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+	if (sdhc_device.asleep)
+	{
+		printf("Card asleep, wake it first.\n");
+		return FAIL;
+	}
+
+	if (sdhc_device.bkops_running && (mmc_bkops_finish() == FAIL))
+	{
+		return FAIL;
+	}
 
 	printf("Send CMD6.\n");
 
-	/* Send CMD6 */
-	if (SUCCESS == host_send_cmd(&cmd))
+	card_set_dto(DTO_SWITCH, timeout_ms);
+
+	/* Send CMD6 and finish on busy end */
+	if (SUCCESS == host_send_fast_cmd(FAST_CMD6, arg))
 	{
-		status = card_trans_status();
+		status = card_busy_done(timeout_ms);
 	}
 
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	if (sdhc_device.switch_unchecked && (response.cmd_rsp0 & R1_SWITCH_ERROR))
+	{
+		mmc_switch_rejected(sdhc_device.switch_arg);
+	}
+
+	sdhc_device.switch_unchecked = (status == SUCCESS) ? TRUE : FALSE;
+	sdhc_device.switch_arg = arg;
+
 	return status;
 }
 
+/*!
+ * @brief Check the last switch for SWITCH_ERROR with one CMD13
+ *
+ * Called once at the end of a batch of switches; does nothing if the
+ * last switch was already checked.
+ *
+ * @return             0 if the card took the switch; 1 otherwise
+ */
+static int mmc_switch_check(void)
+{
+	if (!sdhc_device.switch_unchecked)
+	{
+		return SUCCESS;
+	}
+
+	sdhc_device.switch_unchecked = FALSE;
+
+	if (card_trans_status() == FAIL)
+	{
+		mmc_switch_rejected(sdhc_device.switch_arg);
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Check switch ability and switch function 
+ * 
+ * @param instance     Instance number of the uSDHC module.
+ * @param arg          Argument to command 6 
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+static int mmc_switch(uint32_t arg)
+{
+	int timeout = sdhc_device.switch_timeout;
+
+	return mmc_switch_timeout(arg, timeout ? timeout : MMC_SWITCH_DEF_TIMEOUT);
+}
+
 static int mmc_set_bus_width(int bus_width)
 {
 	return mmc_switch(MMC_SWITCH_SETBW_ARG(bus_width));
@@ -140,11 +277,700 @@ static int mmc_read_csd(void)
 
 		csd_reg.csds = (csd_reg.response[3] & 0xC0000000) >> 30;
 		csd_reg.ssv = (csd_reg.response[3] & 0x3C000000) >> 26;
+		csd_reg.taac = mmc_csd_bits(112, 8);
+		csd_reg.nsac = mmc_csd_bits(104, 8);
+		csd_reg.read_bl_len = mmc_csd_bits(80, 4);
+		csd_reg.c_size = mmc_csd_bits(62, 12);
+		csd_reg.c_size_mult = mmc_csd_bits(47, 3);
+		csd_reg.r2w_factor = mmc_csd_bits(26, 3);
+
+		/* TAAC: unit 1ns * 10^(bits 2:0), multiplier (bits 6:3) / 10 */
+		sdhc_device.taac_ns = taac_unit_ns[csd_reg.taac & 0x7] *
+				      taac_mult[(csd_reg.taac >> 3) & 0xF] / 10;
+		sdhc_device.nsac_clks = csd_reg.nsac * 100;
+		sdhc_device.r2w_factor = csd_reg.r2w_factor;
+
+		printf("TAAC %d ns, NSAC %d clocks, R2W %d, READ_BL_LEN %d, C_SIZE 0x%x\n",
+		       sdhc_device.taac_ns, sdhc_device.nsac_clks, sdhc_device.r2w_factor,
+		       csd_reg.read_bl_len, csd_reg.c_size);
 	}
 
 	return status;
 }
 
+/*!
+ * @brief Extract a field from the CSD register
+ * 
+ * @param start        Lowest CSD bit of the field
+ * @param size         Width of the field in bits
+ * 
+ * @return             Field value
+ */
+static uint32_t mmc_csd_bits(int start, int size)
+{
+	int word = start / 32;
+	int shift = start % 32;
+	uint32_t val;
+
+	val = csd_reg.response[word] >> shift;
+
+	if ((shift + size) > 32)
+	{
+		val |= csd_reg.response[word + 1] << (32 - shift);
+	}
+
+	return (size < 32) ? (val & ((1 << size) - 1)) : val;
+}
+
+/*!
+ * @brief Work out erase group size, timeouts and trim/discard support
+ */
+static void mmc_cfg_erase(void)
+{
+	uint8_t *ptr = (uint8_t *) ext_csd_data;
+	uint32_t mult;
+
+	sdhc_device.erase_caps = 0;
+	sdhc_device.sec_count = 0;
+
+	if (mmc_version != MMC_CARD_3_X)
+	{
+		sdhc_device.sec_count = ptr[MMC_ESD_OFF_SEC_CNT] |
+					(ptr[MMC_ESD_OFF_SEC_CNT + 1] << 8) |
+					(ptr[MMC_ESD_OFF_SEC_CNT + 2] << 16) |
+					(ptr[MMC_ESD_OFF_SEC_CNT + 3] << 24);
+
+		if (ptr[MMC_ESD_OFF_SEC_FEATURE] & SEC_GB_CL_EN)
+		{
+			sdhc_device.erase_caps |= ERASE_CAP_TRIM;
+		}
+
+		if (ptr[MMC_ESD_OFF_REV] >= MMC_ESD_REV_4_5)
+		{
+			sdhc_device.erase_caps |= ERASE_CAP_DISCARD;
+		}
+
+		mult = ptr[MMC_ESD_OFF_TRIM_MULT];
+		sdhc_device.trim_timeout = MMC_ERASE_TMO_UNIT * (mult ? mult : 1);
+	}
+
+	/* Byte addressed cards report their size in CSD only */
+	if ((sdhc_device.sec_count == 0) && (csd_reg.c_size != 0xFFF))
+	{
+		sdhc_device.sec_count = (csd_reg.c_size + 1) << (csd_reg.c_size_mult + 2);
+
+		if (csd_reg.read_bl_len >= 9)
+		{
+			sdhc_device.sec_count <<= csd_reg.read_bl_len - 9;
+		}
+		else
+		{
+			sdhc_device.sec_count >>= 9 - csd_reg.read_bl_len;
+		}
+	}
+
+	/* High capacity erase groups are in 512KB units */
+	if ((mmc_version != MMC_CARD_3_X) && (ptr[MMC_ESD_OFF_HC_ERASE_GRP_SIZE] != 0) &&
+	    (mmc_switch(MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_ERASE_GRP_DEF, ONE)) == SUCCESS))
+	{
+		sdhc_device.erase_grp_size = ptr[MMC_ESD_OFF_HC_ERASE_GRP_SIZE] * 1024;
+		mult = ptr[MMC_ESD_OFF_ERASE_TMO_MULT];
+		sdhc_device.erase_timeout = MMC_ERASE_TMO_UNIT * (mult ? mult : 1);
+	}
+	else
+	{
+		/* Legacy erase group: (ERASE_GRP_SIZE + 1) * (ERASE_GRP_MULT + 1) */
+		sdhc_device.erase_grp_size = (mmc_csd_bits(42, 5) + 1) * (mmc_csd_bits(37, 5) + 1);
+		sdhc_device.erase_timeout = MMC_ERASE_TMO_UNIT;
+	}
+
+	printf("Erase group %d sectors, trim %s, discard %s\n", sdhc_device.erase_grp_size,
+	       (sdhc_device.erase_caps & ERASE_CAP_TRIM) ? "yes" : "no",
+	       (sdhc_device.erase_caps & ERASE_CAP_DISCARD) ? "yes" : "no");
+}
+
+/*!
+ * @brief Read the volatile cache size and turn it on if requested
+ */
+static void mmc_cfg_cache(void)
+{
+	uint8_t *ptr = (uint8_t *) ext_csd_data;
+
+	sdhc_device.cache_size = 0;
+	sdhc_device.cache_on = FALSE;
+
+	if ((mmc_version == MMC_CARD_3_X) || (ptr[MMC_ESD_OFF_REV] < MMC_ESD_REV_4_5))
+	{
+		return;
+	}
+
+	sdhc_device.cache_size = ptr[MMC_ESD_OFF_CACHE_SIZE] |
+				 (ptr[MMC_ESD_OFF_CACHE_SIZE + 1] << 8) |
+				 (ptr[MMC_ESD_OFF_CACHE_SIZE + 2] << 16) |
+				 (ptr[MMC_ESD_OFF_CACHE_SIZE + 3] << 24);
+
+	printf("Volatile cache %d KB\n", sdhc_device.cache_size);
+
+	if ((sdhc_device.cache_size != 0) && sdhc_device.cache_en)
+	{
+		mmc_cache_ctrl(TRUE);
+	}
+}
+
+/*!
+ * @brief Read the optimal write and trim sizes for the write scheduler
+ *
+ * OPTIMAL_WRITE_SIZE is 4KB times the value, OPTIMAL_TRIM_UNIT_SIZE is
+ * 4KB times 2^(value - 1). Both only exist from eMMC 5.0 on.
+ */
+static void mmc_cfg_optimal(void)
+{
+	uint8_t *ptr = (uint8_t *) ext_csd_data;
+	uint8_t trim;
+
+	sdhc_device.opt_write_size = MMC_OPT_SIZE_UNIT;
+	sdhc_device.opt_trim_size = MMC_OPT_SIZE_UNIT;
+
+	if ((mmc_version == MMC_CARD_3_X) || (ptr[MMC_ESD_OFF_REV] < MMC_ESD_REV_5_0))
+	{
+		return;
+	}
+
+	if (ptr[MMC_ESD_OFF_OPT_WRITE_SIZE] != 0)
+	{
+		sdhc_device.opt_write_size = ptr[MMC_ESD_OFF_OPT_WRITE_SIZE] * MMC_OPT_SIZE_UNIT;
+	}
+
+	trim = ptr[MMC_ESD_OFF_OPT_TRIM_SIZE];
+	if (trim != 0)
+	{
+		if (trim > (MMC_OPT_TRIM_SHIFT_MAX + 1))
+		{
+			trim = MMC_OPT_TRIM_SHIFT_MAX + 1;
+		}
+
+		sdhc_device.opt_trim_size = MMC_OPT_SIZE_UNIT << (trim - 1);
+	}
+
+	printf("Optimal write %d sectors, trim %d sectors\n",
+	       sdhc_device.opt_write_size, sdhc_device.opt_trim_size);
+}
+
+/*!
+ * @brief Turn the eMMC volatile cache on or off
+ * 
+ * The cache is flushed before it is turned off.
+ * 
+ * @param enable       TRUE to enable, FALSE to disable
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_cache_ctrl(int enable)
+{
+	if (sdhc_device.cache_size == 0)
+	{
+		printf("No volatile cache on card.\n");
+		return FAIL;
+	}
+
+	if (!enable && (mmc_cache_flush() == FAIL))
+	{
+		return FAIL;
+	}
+
+	if ((mmc_switch(MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_CACHE_CTRL, enable ? ONE : ZERO)) == FAIL) ||
+	    (mmc_switch_check() == FAIL))
+	{
+		printf("Fail to %s volatile cache.\n", enable ? "enable" : "disable");
+		return FAIL;
+	}
+
+	sdhc_device.cache_on = enable ? TRUE : FALSE;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Flush the eMMC volatile cache to the flash array
+ * 
+ * Barrier for callers at commit points. Does nothing while the cache is off.
+ * 
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_cache_flush(void)
+{
+	if (!sdhc_device.cache_on)
+	{
+		return SUCCESS;
+	}
+
+	printf("Flush volatile cache.\n");
+
+	if (mmc_switch_timeout(MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_FLUSH_CACHE, ONE),
+			       MMC_CACHE_FLUSH_TIMEOUT) == FAIL)
+	{
+		return FAIL;
+	}
+
+	return mmc_switch_check();
+}
+
+/*!
+ * @brief Read the sleep/awake timeout
+ *
+ * S_A_TIMEOUT is 100 ns times 2^value. Cards that do not report it get
+ * the largest value.
+ */
+static void mmc_cfg_sleep(void)
+{
+	uint8_t sa = ((uint8_t *) ext_csd_data)[MMC_ESD_OFF_S_A_TIMEOUT];
+
+	if ((mmc_version == MMC_CARD_3_X) || (sa == 0) || (sa > MMC_S_A_TIMEOUT_MAX))
+	{
+		sa = MMC_S_A_TIMEOUT_MAX;
+	}
+
+	sdhc_device.sa_timeout = DIV_ROUND_UP(100 << sa, 1000000);
+	sdhc_device.asleep = FALSE;
+
+	printf("Sleep/awake timeout %d ms\n", sdhc_device.sa_timeout);
+}
+
+/*!
+ * @brief Read the manual BKOPS support and enable state
+ */
+static void mmc_cfg_bkops(void)
+{
+	uint8_t *ptr = (uint8_t *) ext_csd_data;
+
+	sdhc_device.bkops_support = FALSE;
+	sdhc_device.bkops_en = FALSE;
+	sdhc_device.bkops_running = FALSE;
+	sdhc_device.bkops_pending = FALSE;
+	sdhc_device.exception = FALSE;
+	sdhc_device.bkops_wr = 0;
+
+	if ((mmc_version == MMC_CARD_3_X) || (ptr[MMC_ESD_OFF_REV] < MMC_ESD_REV_4_41))
+	{
+		return;
+	}
+
+	sdhc_device.bkops_support = ptr[MMC_ESD_OFF_BKOPS_SUPPORT] & 0x1;
+	sdhc_device.bkops_en = ptr[MMC_ESD_OFF_BKOPS_EN] & BKOPS_EN_MANUAL;
+
+	printf("BKOPS %s, %s\n", sdhc_device.bkops_support ? "supported" : "not supported",
+	       sdhc_device.bkops_en ? "enabled" : "disabled");
+}
+
+/*!
+ * @brief Read how badly the card needs background operations
+ *
+ * Clears the pending R1 exception, EXCEPTION_EVENTS_STATUS is read too.
+ *
+ * @return             BKOPS_STATUS level 0 to 3; -1 if EXT_CSD could not be read
+ */
+static int mmc_bkops_level(void)
+{
+	uint8_t *ptr = (uint8_t *) ext_csd_data;
+	int level;
+
+	if (mmc_read_esd() == FAIL)
+	{
+		return -1;
+	}
+
+	level = ptr[MMC_ESD_OFF_BKOPS_STATUS] & BKOPS_LEVEL_MASK;
+
+	/* Urgent BKOPS is reported at level 2 or 3 */
+	if ((ptr[MMC_ESD_OFF_EXCEPTION_STATUS] & EXCEPTION_URGENT_BKOPS) && (level < 2))
+	{
+		level = 2;
+	}
+
+	sdhc_device.exception = FALSE;
+	sdhc_device.bkops_wr = 0;
+
+	return level;
+}
+
+/*!
+ * @brief Enable manual background operations
+ *
+ * BKOPS_EN is one time programmable up to eMMC 5.0, so this is never done
+ * implicitly.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_bkops_enable(void)
+{
+	if (!sdhc_device.bkops_support)
+	{
+		printf("BKOPS not supported by card.\n");
+		return FAIL;
+	}
+
+	if (sdhc_device.bkops_en)
+	{
+		return SUCCESS;
+	}
+
+	if ((mmc_switch(MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_BKOPS_EN, BKOPS_EN_MANUAL)) == FAIL) ||
+	    (mmc_switch_check() == FAIL))
+	{
+		printf("Fail to enable BKOPS.\n");
+		return FAIL;
+	}
+
+	sdhc_device.bkops_en = TRUE;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Give idle time to background operations
+ *
+ * BKOPS_STATUS is only read after an R1 exception event, after
+ * MMC_BKOPS_CHECK_SECTORS written sectors or after HPI cut a BKOPS
+ * short. If the card has anything pending, BKOPS is started and polled
+ * on DAT0 for up to the budget. It may keep running after that, the next
+ * command waits for it or stops it. Nothing is sent while asynchronous
+ * requests are queued.
+ *
+ * @param budget_ms    Idle time to spend
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_bkops_idle(int budget_ms)
+{
+	unsigned int start;
+	int level;
+
+	/* A sleeping card has no idle time to give */
+	if (!sdhc_device.bkops_support || !sdhc_device.bkops_en || sdhc_device.asleep)
+	{
+		return SUCCESS;
+	}
+
+	/* Queued requests own the bus, there is no idle time yet */
+	if (card_async_pending())
+	{
+		return SUCCESS;
+	}
+
+	if (!sdhc_device.bkops_running)
+	{
+		if (!sdhc_device.bkops_pending && !sdhc_device.exception &&
+		    (sdhc_device.bkops_wr < MMC_BKOPS_CHECK_SECTORS))
+		{
+			return SUCCESS;
+		}
+
+		level = mmc_bkops_level();
+		if (level < 0)
+		{
+			return FAIL;
+		}
+
+		if (level == 0)
+		{
+			sdhc_device.bkops_pending = FALSE;
+			return SUCCESS;
+		}
+
+		printf("Start BKOPS, level %d.\n", level);
+
+		/* R1b, the busy lasts as long as the operations */
+		if (host_send_fast_cmd(FAST_CMD6,
+				       MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_BKOPS_START, ONE)) == FAIL)
+		{
+			return FAIL;
+		}
+
+		sdhc_device.bkops_running = TRUE;
+		sdhc_device.bkops_pending = FALSE;
+		sdhc_device.stats.bkops_runs++;
+	}
+
+	start = get_timer(0);
+
+	while (host_card_busy())
+	{
+		if (get_timer(start) >= budget_ms)
+		{
+			return SUCCESS;
+		}
+
+		udelay(100);
+	}
+
+	sdhc_device.bkops_running = FALSE;
+
+	return card_trans_status();
+}
+
+/*!
+ * @brief Stop or wait for a running BKOPS before the next command
+ *
+ * With HPI the card is interrupted, so the delay is bounded by
+ * OUT_OF_INTERRUPT_TIME. Without it the operations run to the end.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_bkops_finish(void)
+{
+	unsigned int start = get_timer(0);
+
+	if (sdhc_device.hpi_en)
+	{
+		return mmc_hpi_preempt();
+	}
+
+	while (host_card_busy())
+	{
+		if (get_timer(start) >= MMC_BKOPS_TIMEOUT)
+		{
+			printf("BKOPS did not end.\n");
+			return FAIL;
+		}
+
+		udelay(100);
+	}
+
+	sdhc_device.bkops_running = FALSE;
+
+	return card_trans_status();
+}
+
+/*!
+ * @brief Turn on High Priority Interrupt if the card has it
+ */
+static void mmc_cfg_hpi(void)
+{
+	uint8_t *ptr = (uint8_t *) ext_csd_data;
+
+	sdhc_device.hpi_en = FALSE;
+
+	if ((mmc_version == MMC_CARD_3_X) || (ptr[MMC_ESD_OFF_REV] < MMC_ESD_REV_4_41) ||
+	    !(ptr[MMC_ESD_OFF_HPI_FEATURES] & HPI_SUPPORT))
+	{
+		return;
+	}
+
+	sdhc_device.hpi_cmd12 = (ptr[MMC_ESD_OFF_HPI_FEATURES] & HPI_USE_CMD12) ? TRUE : FALSE;
+	sdhc_device.hpi_timeout = ptr[MMC_ESD_OFF_OUT_OF_INT_TIME] * MMC_HPI_TIME_UNIT;
+	if (sdhc_device.hpi_timeout == 0)
+	{
+		sdhc_device.hpi_timeout = MMC_HPI_DEF_TIMEOUT;
+	}
+
+	if (mmc_switch(MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_HPI_MGMT, HPI_MGMT_EN)) == FAIL)
+	{
+		printf("Fail to enable HPI.\n");
+		return;
+	}
+
+	sdhc_device.hpi_en = TRUE;
+
+	printf("HPI enabled with CMD%d, %d ms\n", sdhc_device.hpi_cmd12 ? 12 : 13,
+	       sdhc_device.hpi_timeout);
+}
+
+/*!
+ * @brief Interrupt a long card operation so a new command can go out
+ *
+ * Sends HPI with CMD12 or CMD13, whichever the card takes, if the card
+ * holds DAT0 busy. Programming, erase and BKOPS stop within
+ * OUT_OF_INTERRUPT_TIME. An interrupted BKOPS is marked pending, so the
+ * next idle time reads BKOPS_STATUS again and restarts it if needed.
+ *
+ * @return             0 if the card is in TRAN; 1 otherwise
+ */
+int mmc_hpi_preempt(void)
+{
+	uint32_t arg = (sdhc_device.rca << RCA_SHIFT) | MMC_HPI_ARG;
+	unsigned int start;
+
+	if (!host_card_busy())
+	{
+		sdhc_device.bkops_running = FALSE;
+		return SUCCESS;
+	}
+
+	if (!sdhc_device.hpi_en)
+	{
+		printf("HPI not enabled.\n");
+		return FAIL;
+	}
+
+	printf("Send HPI.\n");
+
+	if (host_send_fast_cmd(sdhc_device.hpi_cmd12 ? FAST_CMD12 : FAST_CMD13, arg) == FAIL)
+	{
+		printf("Fail to send HPI.\n");
+		return FAIL;
+	}
+
+	start = get_timer(0);
+
+	while (host_card_busy())
+	{
+		if (get_timer(start) >= sdhc_device.hpi_timeout)
+		{
+			printf("Card still busy after HPI.\n");
+			return FAIL;
+		}
+
+		udelay(100);
+	}
+
+	if (sdhc_device.bkops_running)
+	{
+		sdhc_device.bkops_pending = TRUE;
+	}
+
+	sdhc_device.bkops_running = FALSE;
+	sdhc_device.stats.hpi++;
+
+	return card_trans_status();
+}
+
+/*!
+ * @brief Send the card to SLEEP or wake it to STBY with CMD5
+ *
+ * The card must be deselected before it goes to sleep. Both ways the
+ * card is busy for up to S_A_TIMEOUT.
+ *
+ * @param sleep        TRUE to sleep, FALSE to wake
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_sleep_awake(int sleep)
+{
+	command_t cmd;
+	uint32_t arg = (sdhc_device.rca << RCA_SHIFT) | (sleep ? MMC_SLEEP_ARG : 0);
+
+	card_set_dto(DTO_SWITCH, sdhc_device.sa_timeout);
+
+	card_cmd_config(&cmd, CMD5, arg, READ, RESPONSE_48_CHECK_BUSY, DATA_PRESENT_NONE, TRUE, TRUE);
+
+	printf("Send CMD5 %s.\n", sleep ? "sleep" : "awake");
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		printf("Fail to send CMD5.\n");
+		return FAIL;
+	}
+
+	return host_wait_busy(sdhc_device.sa_timeout);
+}
+
+/*!
+ * @brief Move card and host to one level of the bus speed ladder
+ *
+ * The host drops to the legacy clock while the card changes timing. A
+ * DDR target gets HS_TIMING before the DDR bus width, every other target
+ * leaves DDR before HS_TIMING changes. The level only counts once an
+ * EXT_CSD read works on it.
+ *
+ * @param level        Target level
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int mmc_set_bus_level(bus_level_t level)
+{
+	const bus_level_cfg_t *cfg = &mmc_bus_levels[level];
+	uint32_t width = MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_BUS_WIDTH, cfg->bus_width);
+	uint32_t timing = MMC_SWITCH_WRITE_BYTE(MMC_ESD_OFF_HS_TIMING, cfg->hs_timing);
+
+	printf("Bus level %s.\n", cfg->name);
+
+	host_set_bus_speed(MMC_LEGACY_CLKD, FALSE, FALSE);
+
+	if ((mmc_switch(cfg->ddr ? timing : width) == FAIL) ||
+	    (mmc_switch(cfg->ddr ? width : timing) == FAIL) ||
+	    (mmc_switch_check() == FAIL))
+	{
+		printf("Fail to switch card to %s.\n", cfg->name);
+		return FAIL;
+	}
+
+	host_set_bus_width(cfg->host_width);
+	host_set_bus_speed(cfg->clkd, cfg->hs_timing, cfg->ddr);
+
+	/* No CMD16 for the check read in DDR mode, bus_level is not set yet */
+	sdhc_device.blk_len = cfg->ddr ? BLK_LEN : 0;
+
+	if (mmc_read_esd() == FAIL)
+	{
+		printf("Data check failed at %s.\n", cfg->name);
+		return FAIL;
+	}
+
+	sdhc_device.bus_level = level;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Name of a bus speed level for logs and stats
+ *
+ * @param level        Bus level
+ *
+ * @return             Level name
+ */
+const char *mmc_bus_level_name(bus_level_t level)
+{
+	return (level < BUS_LEVEL_COUNT) ? mmc_bus_levels[level].name : "unknown";
+}
+
+/*!
+ * @brief Run the card at the highest level its CARD_TYPE allows and works
+ *
+ * Each level that fails its check drops to the next one down. A card with
+ * nothing above legacy stays on its identification bus without a switch;
+ * MMC 3.x has no CMD6 or EXT_CSD and only gets its clock, 20 MHz at most.
+ */
+static void mmc_bus_negotiate(void)
+{
+	uint8_t type = ((uint8_t *) ext_csd_data)[MMC_ESD_OFF_CARD_TYPE];
+	int level = BUS_LEGACY_1BIT;
+
+	if (mmc_version != MMC_CARD_3_X)
+	{
+		if (type & CARD_TYPE_DDR52)
+		{
+			level = BUS_DDR52_8BIT;
+		}
+		else if (type & CARD_TYPE_HS52)
+		{
+			level = BUS_HS52_8BIT;
+		}
+	}
+
+	/* Step up never goes past the level that worked here */
+	sdhc_device.bus_level_max = BUS_LEGACY_1BIT;
+
+	if (level == BUS_LEGACY_1BIT)
+	{
+		host_set_bus_speed((mmc_version == MMC_CARD_3_X) ? MMC_3X_CLKD : MMC_LEGACY_CLKD,
+				   FALSE, FALSE);
+		sdhc_device.bus_level = BUS_LEGACY_1BIT;
+		printf("Bus level %s.\n", mmc_bus_levels[BUS_LEGACY_1BIT].name);
+		return;
+	}
+
+	for (; level > BUS_LEGACY_1BIT; level--)
+	{
+		if (mmc_set_bus_level(level) == SUCCESS)
+		{
+			sdhc_device.bus_level_max = level;
+			return;
+		}
+	}
+
+	mmc_set_bus_level(BUS_LEGACY_1BIT);
+}
+
 /*!
  * @brief Read CSD and EXT_CSD value of MMC;
  * 
@@ -169,6 +995,8 @@ static uint32_t mmc_get_spec_ver(void)
 	if (SUCCESS == card_enter_trans())
 	{
 		printf("Card entered trans state successfully\n");
+		card_mark_phase(PHASE_CSD);
+
 		/* Set bus width */
 		if (mmc_set_bus_width(ONE) == SUCCESS)
 		{
@@ -181,6 +1009,7 @@ static uint32_t mmc_get_spec_ver(void)
 		if (SUCCESS == mmc_read_esd())
 		{
 			printf("esd read success\n");
+			card_mark_phase(PHASE_EXT_CSD);
 			retv |= (ext_csd_data[48] & 0x00FF0000) | ((ext_csd_data[57] & 0xFF) << 24);
 		}
 	}
@@ -232,6 +1061,11 @@ void emmc_print_cfg_info(void)
 {
 	uint8_t byte, *ptr;
 
+	if (sdhc_device.card_type != CARD_EMMC) {
+		printf("Not an eMMC card.\n");
+		return;
+	}
+
 	if (mmc_version == MMC_CARD_INV) {
 		printf("Invalid or uinitialized card.\n");
 		return;
@@ -264,7 +1098,12 @@ void emmc_print_cfg_info(void)
 	printf("\tDDR boot mode %s\n", (byte == BBW_DDR) ? "enabled" : "disabled");
 
 	byte = ptr[MMC_ESD_OFF_BT_BW] & BBW_SAVE;
-	printf("\t%s boot bus width settings.\n\n", (byte == 0) ? "Discard" : "Retain");
+	printf("\t%s boot bus width settings.\n", (byte == 0) ? "Discard" : "Retain");
+
+	printf("\tErase group size: %d sectors\n", sdhc_device.erase_grp_size);
+
+	printf("\tVolatile cache: %d KB, %s\n\n", sdhc_device.cache_size,
+	       sdhc_device.cache_on ? "enabled" : "disabled");
 }	
 
 /*!
@@ -282,6 +1121,14 @@ int emmc_init(void)
 
 	/* Init MMC version */
 	mmc_version = MMC_CARD_INV;
+	sdhc_device.switch_unchecked = FALSE;
+
+	/* EXT_CSD lives in the device arena */
+	ext_csd_data = sdhc_arena_alloc(BLK_LEN);
+	if (!ext_csd_data)
+	{
+		return FAIL;
+	}
 
 	/* Get CID */
 	if (card_get_cid() == SUCCESS)
@@ -291,6 +1138,7 @@ int emmc_init(void)
 		if (mmc_set_rca() == SUCCESS)
 		{
 			printf("Successfully set relative card address\n");
+			card_mark_phase(PHASE_IDENT);
 			status = SUCCESS;
 
 			retv = mmc_get_spec_ver();
@@ -318,8 +1166,30 @@ int emmc_init(void)
                 		mmc_version = MMC_CARD_3_X;
                 		printf("\tMMC 3.X or older cards.\n");
             		}
+
+			/* GENERIC_CMD6_TIME is in 10ms units */
+			sdhc_device.switch_timeout = 0;
+			if ((mmc_version != MMC_CARD_3_X) &&
+			    (((uint8_t *) ext_csd_data)[MMC_ESD_OFF_REV] >= MMC_ESD_REV_4_5))
+			{
+				sdhc_device.switch_timeout = ((uint8_t *) ext_csd_data)[MMC_ESD_OFF_CMD6_TIME] * 10;
+			}
+
+			mmc_cfg_erase();
+			mmc_cfg_cache();
+			mmc_cfg_optimal();
+			mmc_cfg_sleep();
+			mmc_cfg_bkops();
+			mmc_cfg_hpi();
+			mmc_switch_check();
+			card_mark_phase(PHASE_CONFIG);
+
+			mmc_bus_negotiate();
+			card_mark_phase(PHASE_BUS_MODE);
 		}
 	}
+
+	return status;
 }
 
 /*!
@@ -335,7 +1205,6 @@ int mmc_omap_validation(void)
 	command_response_t response;
 	int count = ZERO;
 	int status = FAIL;
-	unsigned int val = 0;
 
 	/* Configure CMD5 */
 	card_cmd_config(&cmd, CMD5, ((sdhc_device.rca << RCA_SHIFT) | 0x00008000), WRITE, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
@@ -356,7 +1225,7 @@ int mmc_omap_validation(void)
 	}
 	
 	/*Set appropriate bits in SD_IE register*/
-	__raw_writel(0x327f0033, 0x481D8234);
+	host_set_irq(0x327f0033);
 	
 	sdhc_cmd_cfg(&cmd);
 
@@ -380,14 +1249,7 @@ int mmc_omap_validation(void)
 	}
 	
 	/* Software reset */
-	val = __raw_readl(0x481D822C) & ~0x02000000;
-	val |= 0x02000000;
-	__raw_writel(val, 0x481D822C);
-	
-	while (__raw_readl(0x481D822C) & 0x02000000)
-	{
-		;
-	}
+	host_reset_line(0x02000000);
 	printf("Software reset done\n");
 
 		
@@ -453,51 +1315,61 @@ int mmc_omap_validation(void)
  */
 int mmc_voltage_validation(void)
 {
-	command_t cmd;
-	command_response_t response;
 	int count = ZERO;
-	int status = FAIL;
-	unsigned int ocr_val = MMC_HV_HC_OCR_VALUE;
+	int status;
 
-	while ((count < MMC_VOLT_VALID_COUNT) && (status == FAIL))
+	while ((status = mmc_ocr_poll()) == REQ_PENDING)
 	{
-		/* Configure CMD1 */
-		card_cmd_config(&cmd, CMD1, ocr_val, WRITE, RESPONSE_48, DATA_PRESENT_NONE, FALSE, FALSE);
-
-		/* Send CMD1 */
-		if (host_send_cmd(&cmd) == FAIL)
+		if (++count >= MMC_VOLT_VALID_COUNT)
 		{
-			printf("Send CMD1 failed\n");
-			break;
+			return FAIL;
 		}
-		else
-		{
-			/* Check Response */
-			response.format = RESPONSE_48;
-			host_read_response(&response);
 
-			/* Check Busy Bit Cleared or NOT */
-			if (response.cmd_rsp0 & CARD_BUSY_BIT)
-			{
-				/* Check Address Mode */
-				if ((response.cmd_rsp0 & MMC_OCR_HC_BIT_MASK) == MMC_OCR_HC_RESP_VAL)
-				{
-					sdhc_device.addr_mode = SECT_MODE;
-				}
-				else
-				{
-					sdhc_device.addr_mode = BYTE_MODE;
-				}
-
-				status = SUCCESS;
-			}
-			else
-			{
-				count++;
-				udelay(MMC_VOLT_VALID_DELAY);
-			}
-		}
+		udelay(MMC_VOLT_VALID_DELAY);
 	}
 
 	return status;
 }
+
+/*!
+ * @brief Send one CMD1 and check whether the card finished powering up
+ *
+ * @return             REQ_PENDING while the card is busy; 0 if ready; 1 otherwise
+ */
+int mmc_ocr_poll(void)
+{
+	command_t cmd;
+	command_response_t response;
+
+	/* Configure CMD1 */
+	card_cmd_config(&cmd, CMD1, MMC_HV_HC_OCR_VALUE, WRITE, RESPONSE_48, DATA_PRESENT_NONE, FALSE, FALSE);
+
+	/* Send CMD1 */
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		printf("Send CMD1 failed\n");
+		return FAIL;
+	}
+
+	/* Check Response */
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	/* Check Busy Bit Cleared or NOT */
+	if (!(response.cmd_rsp0 & CARD_BUSY_BIT))
+	{
+		return REQ_PENDING;
+	}
+
+	/* Check Address Mode */
+	if ((response.cmd_rsp0 & MMC_OCR_HC_BIT_MASK) == MMC_OCR_HC_RESP_VAL)
+	{
+		sdhc_device.addr_mode = SECT_MODE;
+	}
+	else
+	{
+		sdhc_device.addr_mode = BYTE_MODE;
+	}
+
+	return SUCCESS;
+}
@@ -11,6 +11,9 @@
 
 #define MMC_SWITCH_SET_PARAM_SHIFT 0x8
 
+/* write one EXT_CSD byte */
+#define MMC_SWITCH_WRITE_BYTE(idx, val) (0x03000000 | ((idx) << 16) | ((val) << MMC_SWITCH_SET_PARAM_SHIFT))
+
 /* boot bus width */
 #define BBW_1BIT 	(0x0<<0)
 #define BBW_4BIT 	(0x1<<0)
@@ -35,6 +38,100 @@
 /* offset in esd */
 #define MMC_ESD_OFF_PRT_CFG 179
 #define MMC_ESD_OFF_BT_BW 177
+#define MMC_ESD_OFF_ERASE_GRP_DEF 175
+#define MMC_ESD_OFF_REV 192
+#define MMC_ESD_OFF_SEC_CNT 212
+#define MMC_ESD_OFF_ERASE_TMO_MULT 223
+#define MMC_ESD_OFF_HC_ERASE_GRP_SIZE 224
+#define MMC_ESD_OFF_SEC_FEATURE 231
+#define MMC_ESD_OFF_TRIM_MULT 232
+#define MMC_ESD_OFF_FLUSH_CACHE 32
+#define MMC_ESD_OFF_CACHE_CTRL 33
+#define MMC_ESD_OFF_EXCEPTION_STATUS 54
+#define MMC_ESD_OFF_HPI_MGMT 161
+#define MMC_ESD_OFF_BKOPS_EN 163
+#define MMC_ESD_OFF_BKOPS_START 164
+#define MMC_ESD_OFF_BUS_WIDTH 183
+#define MMC_ESD_OFF_HS_TIMING 185
+#define MMC_ESD_OFF_CARD_TYPE 196
+#define MMC_ESD_OFF_OUT_OF_INT_TIME 198
+#define MMC_ESD_OFF_CMD6_TIME 248
+#define MMC_ESD_OFF_CACHE_SIZE 249
+#define MMC_ESD_OFF_BKOPS_STATUS 246
+#define MMC_ESD_OFF_S_A_TIMEOUT 217
+#define MMC_ESD_OFF_OPT_TRIM_SIZE 264
+#define MMC_ESD_OFF_OPT_WRITE_SIZE 265
+#define MMC_ESD_OFF_BKOPS_SUPPORT 502
+#define MMC_ESD_OFF_HPI_FEATURES 503
+
+/* CARD_TYPE */
+#define CARD_TYPE_HS52	(0x1<<1)
+#define CARD_TYPE_DDR52	(0x1<<2)
+
+/* BUS_WIDTH values */
+#define ESD_BUS_WIDTH_1		0
+#define ESD_BUS_WIDTH_4		1
+#define ESD_BUS_WIDTH_8		2
+#define ESD_BUS_WIDTH_8_DDR	6
+
+/* SD_SYSCTL CLKD of the legacy and high speed levels, 24 and 48 MHz */
+#define MMC_LEGACY_CLKD 4
+#define MMC_HS_CLKD 2
+
+/* SD_SYSCTL CLKD of MMC 3.x, 19.2 MHz under its 20 MHz limit */
+#define MMC_3X_CLKD 5
+
+/* SEC_FEATURE_SUPPORT */
+#define SEC_GB_CL_EN	(0x1<<4)
+
+/* EXT_CSD_REV of eMMC 4.41 and 4.5 */
+#define MMC_ESD_REV_4_41 5
+#define MMC_ESD_REV_4_5 6
+
+/* EXT_CSD_REV of eMMC 5.0, first with the OPTIMAL_* sizes */
+#define MMC_ESD_REV_5_0 7
+
+/* EXCEPTION_EVENTS_STATUS, BKOPS_EN and BKOPS_STATUS */
+#define EXCEPTION_URGENT_BKOPS	(0x1<<0)
+#define BKOPS_EN_MANUAL		(0x1<<0)
+#define BKOPS_LEVEL_MASK	0x3
+
+/* HPI_FEATURES and HPI_MGMT */
+#define HPI_SUPPORT	(0x1<<0)
+#define HPI_USE_CMD12	(0x1<<1)
+#define HPI_MGMT_EN	(0x1<<0)
+
+/* HPI bit of the CMD12/CMD13 argument */
+#define MMC_HPI_ARG 0x1
+
+/* OUT_OF_INTERRUPT_TIME unit, and the wait when it is not reported, in ms */
+#define MMC_HPI_TIME_UNIT 10
+#define MMC_HPI_DEF_TIMEOUT 100
+
+/* Sleep bit of the CMD5 argument */
+#define MMC_SLEEP_ARG 0x00008000
+
+/* S_A_TIMEOUT is 100 ns times 2^value, the value is at most 0x17 */
+#define MMC_S_A_TIMEOUT_MAX 0x17
+
+/* Sectors written before idle time checks BKOPS_STATUS again */
+#define MMC_BKOPS_CHECK_SECTORS 8192
+
+/* Longest wait for a running BKOPS to end in ms */
+#define MMC_BKOPS_TIMEOUT 30000
+
+/* erase/trim timeout unit of EXT_CSD multipliers in ms */
+#define MMC_ERASE_TMO_UNIT 300
+
+/* OPTIMAL_*_SIZE unit, and the default when not reported, in sectors */
+#define MMC_OPT_SIZE_UNIT 8
+
+/* Largest OPTIMAL_TRIM_UNIT_SIZE exponent taken, 2^20 units is 4 GB */
+#define MMC_OPT_TRIM_SHIFT_MAX 20
+
+/* CMD6 busy timeouts in ms */
+#define MMC_SWITCH_DEF_TIMEOUT 500
+#define MMC_CACHE_FLUSH_TIMEOUT 30000
 
 enum mmc_ver_e {
     MMC_CARD_3_X,
@@ -48,10 +145,36 @@ struct csd_struct {
 
     uint8_t ssv;                //system spec version
     uint8_t csds;               //CSD structure
+    uint8_t taac;               //data read access time 1
+    uint8_t nsac;               //data read access time 2, 100 clock units
+    uint8_t r2w_factor;         //write speed factor
+    uint8_t read_bl_len;        //max read block length, log2
+    uint16_t c_size;            //device size
+    uint8_t c_size_mult;        //device size multiplier
 };
 
+/* One step of the bus speed ladder */
+typedef struct {
+    const char *name;
+    uint8_t bus_width;          //EXT_CSD BUS_WIDTH value
+    uint8_t hs_timing;          //EXT_CSD HS_TIMING value
+    uint8_t host_width;         //host data width 1, 4 or 8
+    uint8_t ddr;                //dual data rate
+    uint16_t clkd;              //SD_SYSCTL CLKD
+} bus_level_cfg_t;
+
 extern int emmc_init(void);
 extern int mmc_voltage_validation(void);
+extern int mmc_ocr_poll(void);
 extern void emmc_print_cfg_info(void);
+extern int mmc_cache_ctrl(int enable);
+extern int mmc_cache_flush(void);
+extern int mmc_set_bus_level(bus_level_t level);
+extern int mmc_bkops_enable(void);
+extern int mmc_bkops_idle(int budget_ms);
+extern int mmc_bkops_finish(void);
+extern int mmc_hpi_preempt(void);
+extern int mmc_sleep_awake(int sleep);
+extern const char *mmc_bus_level_name(bus_level_t level);
 
 #endif
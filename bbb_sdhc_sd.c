@@ -0,0 +1,486 @@
+#include <bbb_types.h>
+#include <bbb_sdhc.h>
+#include <bbb_sdhc_host.h>
+#include <bbb_sdhc_mmc.h>
+#include <bbb_sdhc_sd.h>
+#include <common.h>
+#include <command.h>
+#include <errno.h>
+#include <autoboot.h>
+#include <bootretry.h>
+#include <cli.h>
+#include <console.h>
+#include <fdtdec.h>
+#include <menu.h>
+#include <post.h>
+#include <u-boot/sha256.h>
+
+static uint32_t sd_csd[4];
+static uint8_t *sd_switch_data;
+static unsigned char sd_hs;
+static unsigned char sd_cmd6;
+
+/* Bus speed ladder names, SD only uses the two lowest levels */
+static const char *const sd_bus_names[BUS_LEVEL_COUNT] = {
+	[BUS_LEGACY_1BIT] = "SD default 1-bit",
+	[BUS_HS_4BIT]     = "SD HS 4-bit",
+};
+
+int sd_if_cond(void);
+static int sd_app_cmd(void);
+int sd_ocr_poll(int hcs);
+static int sd_get_rca(void);
+static uint32_t sd_csd_bits(int start, int size);
+static int sd_read_csd(void);
+static int sd_set_bus_width(int width);
+static int sd_switch_func(uint32_t arg);
+static int sd_read_scr(void);
+int sd_set_bus_level(bus_level_t level);
+const char *sd_bus_level_name(bus_level_t level);
+static void sd_bus_negotiate(void);
+int sd_init(void);
+
+/*!
+ * @brief Send CMD8 to tell an SD 2.0 card from anything else
+ *
+ * SD 2.0 cards echo the check pattern. SD 1.x and eMMC cards in IDLE do
+ * not answer, the command line is reset for the next probe then.
+ *
+ * @return             0 if an SD 2.0 card answered; 1 otherwise
+ */
+int sd_if_cond(void)
+{
+	command_t cmd;
+	command_response_t response;
+
+	card_cmd_config(&cmd, CMD8, SD_IF_HV_COND_ARG, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+
+	printf("Send CMD8 (SEND_IF_COND).\n");
+
+	if (host_send_cmd(&cmd) == SUCCESS)
+	{
+		response.format = RESPONSE_48;
+		host_read_response(&response);
+
+		if ((response.cmd_rsp0 & SD_IF_COND_MASK) == SD_IF_HV_COND_ARG)
+		{
+			return SUCCESS;
+		}
+
+		printf("CMD8 echo 0x%x mismatch.\n", response.cmd_rsp0);
+	}
+
+	host_reset_line(0x02000000);
+
+	return FAIL;
+}
+
+/*!
+ * @brief Send CMD55 ahead of an application command
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int sd_app_cmd(void)
+{
+	command_t cmd;
+	command_response_t response;
+
+	card_cmd_config(&cmd, CMD55, (sdhc_device.rca << RCA_SHIFT), READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		printf("Send CMD55 failed\n");
+		return FAIL;
+	}
+
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	return (response.cmd_rsp0 & SD_R1_STATUS_APP_CMD_MSK) ? SUCCESS : FAIL;
+}
+
+/*!
+ * @brief Send one ACMD41 and check whether the card finished powering up
+ *
+ * @param hcs          Ask for high capacity, only for cards that answered CMD8
+ *
+ * @return             REQ_PENDING while the card is busy; 0 if ready; 1 otherwise
+ */
+int sd_ocr_poll(int hcs)
+{
+	command_t cmd;
+	command_response_t response;
+
+	if (sd_app_cmd() == FAIL)
+	{
+		return FAIL;
+	}
+
+	/* R3 carries no CRC or command index */
+	card_cmd_config(&cmd, ACMD41, hcs ? SD_OCR_VALUE_HV_HC : SD_OCR_VALUE_HV_LC, READ,
+			RESPONSE_48, DATA_PRESENT_NONE, FALSE, FALSE);
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		printf("Send ACMD41 failed\n");
+		return FAIL;
+	}
+
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	if (!(response.cmd_rsp0 & CARD_BUSY_BIT))
+	{
+		return REQ_PENDING;
+	}
+
+	/* CCS set means block addressing */
+	sdhc_device.addr_mode = (response.cmd_rsp0 & SD_OCR_HC_RES) ? SECT_MODE : BYTE_MODE;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Ask the card to publish its RCA with CMD3
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int sd_get_rca(void)
+{
+	command_t cmd;
+	command_response_t response;
+
+	card_cmd_config(&cmd, CMD3, NO_ARG, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+
+	printf("Send CMD3.\n");
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		return FAIL;
+	}
+
+	/* R6: RCA in the upper half */
+	response.format = RESPONSE_48;
+	host_read_response(&response);
+
+	sdhc_device.rca = response.cmd_rsp0 >> RCA_SHIFT;
+
+	return (sdhc_device.rca != 0) ? SUCCESS : FAIL;
+}
+
+/*!
+ * @brief Extract a field from the CSD register
+ *
+ * @param start        Lowest CSD bit of the field
+ * @param size         Width of the field in bits
+ *
+ * @return             Field value
+ */
+static uint32_t sd_csd_bits(int start, int size)
+{
+	int word = start / 32;
+	int shift = start % 32;
+	uint32_t val;
+
+	val = sd_csd[word] >> shift;
+
+	if ((shift + size) > 32)
+	{
+		val |= sd_csd[word + 1] << (32 - shift);
+	}
+
+	return (size < 32) ? (val & ((1 << size) - 1)) : val;
+}
+
+/*!
+ * @brief Read the CSD and work out size, erase unit and write speed
+ *
+ * TAAC and NSAC are fixed on high capacity cards and say nothing on the
+ * others, so data timeouts stay at the 100 ms read and 250 ms write
+ * floors the SD spec asks for.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int sd_read_csd(void)
+{
+	command_t cmd;
+	command_response_t response;
+	uint32_t bl_len;
+
+	card_cmd_config(&cmd, CMD9, (sdhc_device.rca << RCA_SHIFT), READ, RESPONSE_136, DATA_PRESENT_NONE, TRUE, FALSE);
+
+	printf("Send CMD9.\n");
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		return FAIL;
+	}
+
+	response.format = RESPONSE_136;
+	host_read_response(&response);
+
+	sd_csd[0] = response.cmd_rsp0;
+	sd_csd[1] = response.cmd_rsp1;
+	sd_csd[2] = response.cmd_rsp2;
+	sd_csd[3] = response.cmd_rsp3;
+
+	if (sd_csd_bits(126, 2) == SD_CSD_V2)
+	{
+		sdhc_device.sec_count = (sd_csd_bits(48, 22) + 1) * SD_CSD_V2_SIZE_UNIT;
+	}
+	else
+	{
+		bl_len = sd_csd_bits(80, 4);
+		sdhc_device.sec_count = (sd_csd_bits(62, 12) + 1) << (sd_csd_bits(47, 3) + 2);
+		sdhc_device.sec_count = (bl_len >= 9) ? (sdhc_device.sec_count << (bl_len - 9)) :
+					(sdhc_device.sec_count >> (9 - bl_len));
+	}
+
+	sdhc_device.taac_ns = 0;
+	sdhc_device.nsac_clks = 0;
+	sdhc_device.r2w_factor = sd_csd_bits(26, 3);
+
+	/* ERASE_BLK_EN allows single sectors, else SECTOR_SIZE is the unit */
+	sdhc_device.erase_grp_size = sd_csd_bits(46, 1) ? 1 : (sd_csd_bits(39, 7) + 1);
+	sdhc_device.erase_timeout = SD_ERASE_TMO;
+	sdhc_device.trim_timeout = SD_ERASE_TMO;
+	sdhc_device.erase_caps = 0;
+
+	printf("SD CSD %d.0, %d sectors, erase unit %d sectors\n", sd_csd_bits(126, 2) + 1,
+	       sdhc_device.sec_count, sdhc_device.erase_grp_size);
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Set the card bus width with ACMD6
+ *
+ * @param width        SD_BUS_WIDTH_1 or SD_BUS_WIDTH_4
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int sd_set_bus_width(int width)
+{
+	command_t cmd;
+
+	if (sd_app_cmd() == FAIL)
+	{
+		return FAIL;
+	}
+
+	card_cmd_config(&cmd, ACMD6, width, READ, RESPONSE_48, DATA_PRESENT_NONE, TRUE, TRUE);
+
+	printf("Send ACMD6.\n");
+
+	return host_send_cmd(&cmd);
+}
+
+/*!
+ * @brief Check or switch a card function with CMD6
+ *
+ * The 64 byte switch status lands in sd_switch_data.
+ *
+ * @param arg          SD_SWITCH_CHECK or SD_SWITCH_SET with the function
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int sd_switch_func(uint32_t arg)
+{
+	command_t cmd;
+
+	host_cfg_block(SD_SWITCH_STATUS_LEN, ONE);
+
+	card_set_dto(DTO_READ, 0);
+
+	card_cmd_config(&cmd, CMD6, arg, READ, RESPONSE_48, DATA_PRESENT, TRUE, TRUE);
+
+	printf("Send CMD6 0x%x.\n", arg);
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		return FAIL;
+	}
+
+	return host_data_read((int *) sd_switch_data, SD_SWITCH_STATUS_LEN, SDHC_BLKATTR_WML_BLOCK);
+}
+
+/*!
+ * @brief Read the SD configuration register with ACMD51
+ *
+ * The 8 byte SCR lands in sd_switch_data. Every SD card has it, so it
+ * also serves as the data check on cards without CMD6.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+static int sd_read_scr(void)
+{
+	command_t cmd;
+
+	if (sd_app_cmd() == FAIL)
+	{
+		return FAIL;
+	}
+
+	host_cfg_block(SD_SCR_LEN, ONE);
+
+	card_set_dto(DTO_READ, 0);
+
+	card_cmd_config(&cmd, ACMD51, NO_ARG, READ, RESPONSE_48, DATA_PRESENT, TRUE, TRUE);
+
+	printf("Send ACMD51.\n");
+
+	if (host_send_cmd(&cmd) == FAIL)
+	{
+		return FAIL;
+	}
+
+	return host_data_read((int *) sd_switch_data, SD_SCR_LEN, SDHC_BLKATTR_WML_BLOCK);
+}
+
+/*!
+ * @brief Move card and host to one level of the bus speed ladder
+ *
+ * Width changes first at the default clock, then the access mode. The
+ * level only counts once a CMD6 status read, or an SCR read on cards
+ * without CMD6, works on it.
+ *
+ * @param level        BUS_LEGACY_1BIT or BUS_HS_4BIT
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int sd_set_bus_level(bus_level_t level)
+{
+	int wide = (level == BUS_HS_4BIT);
+	uint32_t func = (wide && sd_hs) ? SD_FUNC_HS : SD_FUNC_DEFAULT;
+
+	if (level > BUS_HS_4BIT)
+	{
+		return FAIL;
+	}
+
+	printf("Bus level %s.\n", sd_bus_names[level]);
+
+	host_set_bus_speed(SD_DS_CLKD, FALSE, FALSE);
+
+	if (sd_set_bus_width(wide ? SD_BUS_WIDTH_4 : SD_BUS_WIDTH_1) == FAIL)
+	{
+		printf("Fail to switch card to %s.\n", sd_bus_names[level]);
+		return FAIL;
+	}
+
+	host_set_bus_width(wide ? 4 : 1);
+
+	if (sd_hs && ((sd_switch_func(SD_SWITCH_SET | func) == FAIL) ||
+		      ((sd_switch_data[SD_SWITCH_GRP1_RESULT] & 0xF) != func)))
+	{
+		printf("Fail to switch card to %s.\n", sd_bus_names[level]);
+		return FAIL;
+	}
+
+	host_set_bus_speed((func == SD_FUNC_HS) ? SD_HS_CLKD : SD_DS_CLKD, func == SD_FUNC_HS, FALSE);
+
+	if ((sd_cmd6 ? sd_switch_func(SD_SWITCH_CHECK | func) : sd_read_scr()) == FAIL)
+	{
+		printf("Data check failed at %s.\n", sd_bus_names[level]);
+		return FAIL;
+	}
+
+	sdhc_device.bus_level = level;
+
+	return SUCCESS;
+}
+
+/*!
+ * @brief Name of a bus speed level for logs and stats
+ *
+ * @param level        Bus level
+ *
+ * @return             Level name
+ */
+const char *sd_bus_level_name(bus_level_t level)
+{
+	return ((level < BUS_LEVEL_COUNT) && sd_bus_names[level]) ? sd_bus_names[level] : "unknown";
+}
+
+/*!
+ * @brief Run the card 4-bit, at high speed if it has the function
+ *
+ * SD 1.0 cards have no CMD6, the SCR tells; they stay 4-bit at the
+ * default speed.
+ */
+static void sd_bus_negotiate(void)
+{
+	sd_hs = FALSE;
+	sd_cmd6 = FALSE;
+
+	/* SD_SPEC is the low nibble of the first SCR byte */
+	if ((sd_read_scr() == SUCCESS) && ((sd_switch_data[0] & 0xF) >= SD_SPEC_1_10))
+	{
+		sd_cmd6 = TRUE;
+	}
+
+	if (sd_cmd6 && (sd_switch_func(SD_SWITCH_CHECK | SD_FUNC_HS) == SUCCESS) &&
+	    (sd_switch_data[SD_SWITCH_GRP1_SUPPORT] & (1 << SD_FUNC_HS)))
+	{
+		sd_hs = TRUE;
+	}
+
+	printf("SD high speed %ssupported\n", sd_hs ? "" : "not ");
+
+	sdhc_device.bus_level_max = BUS_HS_4BIT;
+
+	if (sd_set_bus_level(BUS_HS_4BIT) == FAIL)
+	{
+		sd_set_bus_level(BUS_LEGACY_1BIT);
+	}
+}
+
+/*!
+ * @brief Initialize an SD card - Get Card ID, RCA, CSD, then bus mode.
+ *
+ * eMMC only features (cache, BKOPS, HPI, sleep) are left off.
+ *
+ * @return             0 if successful; 1 otherwise
+ */
+int sd_init(void)
+{
+	/* Switch status lives in the slot EXT_CSD takes on eMMC */
+	sd_switch_data = sdhc_arena_alloc(BLK_LEN);
+	if (!sd_switch_data)
+	{
+		return FAIL;
+	}
+
+	if ((card_get_cid() == FAIL) || (sd_get_rca() == FAIL))
+	{
+		printf("SD identification failed\n");
+		return FAIL;
+	}
+
+	printf("SD card RCA 0x%x\n", sdhc_device.rca);
+	card_mark_phase(PHASE_IDENT);
+
+	if ((sd_read_csd() == FAIL) || (card_enter_trans() == FAIL))
+	{
+		return FAIL;
+	}
+	card_mark_phase(PHASE_CSD);
+
+	sdhc_device.switch_timeout = 0;
+	sdhc_device.cache_size = 0;
+	sdhc_device.cache_on = FALSE;
+	sdhc_device.opt_write_size = MMC_OPT_SIZE_UNIT;
+	sdhc_device.opt_trim_size = 0;
+	sdhc_device.bkops_support = FALSE;
+	sdhc_device.bkops_en = FALSE;
+	sdhc_device.bkops_running = FALSE;
+	sdhc_device.hpi_en = FALSE;
+	sdhc_device.sa_timeout = 0;
+	sdhc_device.asleep = FALSE;
+	card_mark_phase(PHASE_CONFIG);
+
+	sd_bus_negotiate();
+	card_mark_phase(PHASE_BUS_MODE);
+
+	return SUCCESS;
+}
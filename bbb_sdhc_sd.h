@@ -0,0 +1,43 @@
+#ifndef __SDHC_SD_H__
+#define __SDHC_SD_H__
+
+/* Check pattern and voltage bits of CMD8, echoed back in R7 */
+#define SD_IF_COND_MASK 0xFFF
+
+/* ACMD6 bus width arguments */
+#define SD_BUS_WIDTH_1 0
+#define SD_BUS_WIDTH_4 2
+
+/* CMD6 switch function, mode bit and function group 1 (access mode) */
+#define SD_SWITCH_CHECK	0x00FFFFF0
+#define SD_SWITCH_SET	0x80FFFFF0
+#define SD_FUNC_DEFAULT	0
+#define SD_FUNC_HS	1
+
+/* CMD6 status block, group 1 support byte and result byte */
+#define SD_SWITCH_STATUS_LEN	64
+#define SD_SWITCH_GRP1_SUPPORT	13
+#define SD_SWITCH_GRP1_RESULT	16
+
+/* SCR length and SD_SPEC of SD 1.10, the first version with CMD6 */
+#define SD_SCR_LEN	8
+#define SD_SPEC_1_10	1
+
+/* SD_SYSCTL CLKD of default speed and high speed, 24 and 48 MHz */
+#define SD_DS_CLKD 4
+#define SD_HS_CLKD 2
+
+/* CSD_STRUCTURE of SDHC/SDXC, C_SIZE is in 512KB units there */
+#define SD_CSD_V2 1
+#define SD_CSD_V2_SIZE_UNIT 1024
+
+/* Erase timeout per erase unit in ms */
+#define SD_ERASE_TMO 250
+
+extern int sd_if_cond(void);
+extern int sd_ocr_poll(int hcs);
+extern int sd_init(void);
+extern int sd_set_bus_level(bus_level_t level);
+extern const char *sd_bus_level_name(bus_level_t level);
+
+#endif
@@ -14,13 +14,15 @@
 #include <u-boot/sha256.h>
 
 /* Buffer Definition */
-static int mmc_test_src[MMC_TEST_BUF_SIZE + MMC_CARD_SECTOR_BUFFER];
-static int mmc_test_dst[MMC_TEST_BUF_SIZE + MMC_CARD_SECTOR_BUFFER];
-static int mmc_test_tmp[MMC_TEST_BUF_SIZE + MMC_CARD_SECTOR_BUFFER];
+static int mmc_test_src[MMC_TEST_BUF_SIZE + MMC_CARD_SECTOR_BUFFER] __aligned(ARCH_DMA_MINALIGN);
+static int mmc_test_dst[MMC_TEST_BUF_SIZE + MMC_CARD_SECTOR_BUFFER] __aligned(ARCH_DMA_MINALIGN);
+static int mmc_test_tmp[MMC_TEST_BUF_SIZE + MMC_CARD_SECTOR_BUFFER] __aligned(ARCH_DMA_MINALIGN);
 
 static int emmc_test_dump(void)
 {
 	emmc_print_cfg_info();
+	card_print_stats();
+	card_print_init_times();
 
 	return TRUE;
 }
@@ -32,8 +34,8 @@ static test_return_t mmc_test(unsigned int bus_width)
 	
 	printf("1. Card -> TMP.\n");
 
-	memset(mmc_test_src, 0x5A, MMC_TEST_BUF_SIZE);
-	memset(mmc_test_dst, 0xA5, MMC_TEST_BUF_SIZE);
+	memset(mmc_test_src, 0x5A, MMC_TEST_BUF_SIZE * sizeof(int));
+	memset(mmc_test_dst, 0xA5, MMC_TEST_BUF_SIZE * sizeof(int));
 
 	status = card_data_read(mmc_test_tmp, MMC_TEST_BUF_SIZE * sizeof(int), MMC_TEST_OFFSET);
 	if (status == FAIL) {
@@ -87,3 +89,12 @@ out:
 }
 
 U_BOOT_CMD(test_cmd, 4, 0, do_cmd, "test command", "prints names wrt switches.\n" "simple test command to check the functionality of u-boot command\n" "valid arguments, [n,m,p,a]");
+
+static int do_sdhc_times(cmd_tbl_t *cmdtp, int flag, int argc, char *const argv[])
+{
+	card_print_init_times();
+
+	return CMD_RET_SUCCESS;
+}
+
+U_BOOT_CMD(sdhc_times, 1, 0, do_sdhc_times, "print eMMC/SD init phase times", "\n" "time of each card init phase since the init start, in us");